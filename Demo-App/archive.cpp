@@ -0,0 +1,160 @@
+module;
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <optional>
+#include <span>
+#include <system_error>
+#include <vector>
+
+module media.archive;
+
+using namespace std; // bad practice - only for presentation!
+
+namespace fs = std::filesystem;
+
+namespace archive {
+
+static constexpr uint32_t Magic   = 0x47494641; // "GIFA"
+static constexpr uint32_t Version = 1;
+
+struct FileHeader {
+	uint32_t Magic_;
+	uint32_t Version_;
+	uint32_t PageSize_;
+	uint32_t Frames_;
+	uint64_t Index_; // offset of the index
+};
+
+static constexpr uint64_t alignUp(uint64_t Offset) noexcept {
+	return (Offset + PageSize - 1) / PageSize * PageSize;
+}
+
+//------------------------------------------------------------------------------
+
+Writer::Writer(fs::path File)
+: File_{ std::move(File) } {
+	Temporary_ = File_;
+	Temporary_ += ".tmp";
+	Out_.open(Temporary_, ios::binary | ios::trunc);
+	pad(PageSize); // the header goes here when complete
+}
+
+// zeros up to the given file size
+void Writer::pad(uint64_t Size) {
+	static constexpr char Zeros[PageSize] = {};
+	while (Size_ < Size) {
+		const auto Count = min<uint64_t>(Size - Size_, PageSize);
+		Out_.write(Zeros, static_cast<streamsize>(Count));
+		Size_ += Count;
+	}
+}
+
+// the offset of the record
+uint64_t Writer::append(const Record & Data) {
+	using video::wire::V2Size;
+	const auto Payload = alignUp(Size_ + V2Size);
+	pad(Payload - V2Size);
+	const auto Header = video::wire::encodeV2(Data.Header_);
+	Out_.write(reinterpret_cast<const char *>(Header.bytes().data()), V2Size);
+	Out_.write(reinterpret_cast<const char *>(Data.Bytes_.data()),
+	           static_cast<streamsize>(Data.Bytes_.size()));
+	Size_ = Payload + Data.Bytes_.size();
+	return Payload - V2Size;
+}
+
+void Writer::add(const Record & Full, const optional<Record> & Delta) {
+	const auto & Header = Full.Header_;
+	IndexEntry Entry{ .Full_ = append(Full) };
+	Entry.Timestamp_ = static_cast<int64_t>(Header.Timestamp_.count());
+	Entry.Sequence_  = Header.Sequence_;
+	if (Delta)
+		Entry.Delta_ = append(*Delta);
+	Index_.push_back(Entry);
+}
+
+bool Writer::finish() {
+	const auto Index = alignUp(Size_);
+	pad(Index);
+	Out_.write(reinterpret_cast<const char *>(Index_.data()),
+	           static_cast<streamsize>(Index_.size() * sizeof(IndexEntry)));
+	const FileHeader Header{ Magic, Version, PageSize,
+		                     static_cast<uint32_t>(Index_.size()), Index };
+	Out_.seekp(0);
+	Out_.write(reinterpret_cast<const char *>(&Header), sizeof(Header));
+	Out_.close();
+	if (!Out_)
+		return false;
+
+	error_code Error;
+	fs::rename(Temporary_, File_, Error);
+	return !Error;
+}
+
+//------------------------------------------------------------------------------
+// all records are checked when the archive is opened. This touches the pages
+// of the headers only, the payloads are paged in when they are sent
+
+optional<Reader> Reader::open(const fs::path & File) {
+	Reader Archive;
+	Archive.Mapping_ = mapping::MappedFile::open(File);
+	if (!Archive.Mapping_)
+		return nullopt;
+
+	const auto & Mapping = *Archive.Mapping_;
+	const auto Bytes     = Mapping.bytes().first(Mapping.intact());
+	FileHeader Header;
+	if (Bytes.size() < sizeof(Header))
+		return nullopt;
+	memcpy(&Header, Bytes.data(), sizeof(Header));
+	if (Header.Magic_ != Magic || Header.Version_ != Version ||
+	    Header.PageSize_ != PageSize || Header.Index_ > Bytes.size() ||
+	    (Bytes.size() - Header.Index_) / sizeof(IndexEntry) < Header.Frames_)
+		return nullopt;
+
+	const auto record = [&](uint64_t Offset) -> optional<Record> {
+		using namespace video::wire;
+		if (Offset > Bytes.size() || Bytes.size() - Offset < V2Size)
+			return nullopt;
+		const auto Wire = Bytes.subspan(Offset).first<V2Size>();
+		if (version(Wire.first<V1Size>()) != 2)
+			return nullopt;
+		const auto Frame   = decodeV2(Wire);
+		const auto Payload = Bytes.subspan(Offset + V2Size);
+		if (Frame.size() > Frame.frameSize() || Frame.size() > Payload.size())
+			return nullopt;
+		return Record{ Frame, Payload.first(Frame.size()) };
+	};
+
+	Archive.Frames_.reserve(Header.Frames_);
+	for (uint32_t i = 0; i < Header.Frames_; ++i) {
+		IndexEntry Entry;
+		memcpy(&Entry, Bytes.data() + Header.Index_ + i * sizeof(Entry),
+		       sizeof(Entry));
+		auto Full = record(Entry.Full_);
+		if (!Full || Full->Header_.Sequence_ != Entry.Sequence_ ||
+		    static_cast<int64_t>(Full->Header_.Timestamp_.count()) !=
+		        Entry.Timestamp_)
+			return nullopt;
+		Archive.Frames_.push_back({ *Full });
+		auto & Frame = Archive.Frames_.back();
+		if (Entry.Delta_ != 0 && !(Frame.Delta_ = record(Entry.Delta_)))
+			return nullopt;
+	}
+	return Archive;
+}
+
+void Reader::willNeed(size_t Index) const noexcept {
+	const auto hint = [this](const Record & Data) {
+		const auto Offset = Data.Bytes_.data() - Mapping_->bytes().data();
+		Mapping_->willNeed(static_cast<size_t>(Offset), Data.Bytes_.size());
+	};
+	const auto & Next = Frames_[Index];
+	hint(Next.Full_);
+	if (Next.Delta_)
+		hint(*Next.Delta_);
+}
+} // namespace archive
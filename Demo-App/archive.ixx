@@ -0,0 +1,103 @@
+module;
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <optional>
+#include <vector>
+
+export module media.archive;
+import media.mapping;
+import video;
+
+using namespace std; // bad practice - only for presentation!
+
+// frame archives: the frames of a media directory, decoded ahead of time into
+// the very payloads which go on the wire. An archive is served straight from
+// its memory mapping, no decoding and no copying involved
+//
+//   header:  magic, version, page size, number of frames, index offset
+//   records: a version 2 wire header right in front of the payload, which
+//            starts on a page boundary
+//   index:   one entry per frame in playing order, with the offsets of the
+//            records of the full frame and of the delta to the frame before,
+//            and the timing of the frame
+//
+// like the catalog, an archive is a plain dump in the byte order of the
+// machine, except for the wire headers
+
+namespace archive {
+
+constexpr uint32_t PageSize = 4096;
+
+// a frame header and the payload that goes with it
+export struct Record {
+	video::FrameHeader Header_;
+	video::tPixels Bytes_;
+};
+
+export struct Frame {
+	Record Full_;
+	optional<Record> Delta_;
+};
+
+struct IndexEntry {
+	uint64_t Full_;
+	uint64_t Delta_; // 0 if there is no delta
+	int64_t Timestamp_;
+	int32_t Sequence_;
+	uint32_t Reserved_ = 0;
+};
+
+// an archive is written to a temporary file first, which replaces the archive
+// file when complete
+
+export class Writer {
+public:
+	[[nodiscard]] explicit Writer(filesystem::path File);
+
+	void add(const Record & Full, const optional<Record> & Delta);
+	// false if the archive couldn't be written
+	bool finish();
+
+private:
+	uint64_t append(const Record & Data);
+	void pad(uint64_t Size);
+
+	filesystem::path File_;
+	filesystem::path Temporary_;
+	ofstream Out_;
+	uint64_t Size_ = 0;
+	vector<IndexEntry> Index_;
+};
+
+// the frames of an archive, backed by its memory mapping
+
+export class Reader {
+public:
+	// nothing if File is no valid frame archive
+	[[nodiscard]] static optional<Reader> open(const filesystem::path & File);
+
+	[[nodiscard]] size_t size() const noexcept {
+		return Frames_.size();
+	}
+	[[nodiscard]] bool empty() const noexcept {
+		return Frames_.empty();
+	}
+	[[nodiscard]] const Frame & operator[](size_t Index) const noexcept {
+		return Frames_[Index];
+	}
+	// the payloads are valid as long as the mapping is held
+	[[nodiscard]] const shared_ptr<const mapping::MappedFile> &
+	mapping() const noexcept {
+		return Mapping_;
+	}
+
+	// hint that the frame at Index will be sent soon
+	void willNeed(size_t Index) const noexcept;
+
+private:
+	shared_ptr<const mapping::MappedFile> Mapping_;
+	vector<Frame> Frames_;
+};
+} // namespace archive
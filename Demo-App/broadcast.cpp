@@ -0,0 +1,632 @@
+﻿module;
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <climits>
+#include <coroutine>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#	include <emmintrin.h>
+#endif
+
+module video.broadcast;
+
+import generator;
+import media.archive;
+import video.decoder;
+import video.packing;
+import video.pixels;
+
+using namespace std;         // bad practice - only for presentation!
+using namespace std::chrono; // bad practice - only for presentation!
+using namespace net;
+
+namespace broadcast {
+
+// pace the frames of a frame sequence according to their timestamps
+// the timer expires when the frame is due, the barrier returns how late the
+// frame is already. A frame late beyond MaxLateness moves the schedule of
+// the frames after it, as if it had been on time. The first frame of a
+// sequence is never late, the next sequence starts right away. Frames without
+// a sequence, like fillers, are due when the frame before has had its time
+
+static auto makeTimedBarrier(tTimer & Timer, milliseconds MaxLateness) {
+	auto StartTime = steady_clock::now();
+	auto Timestamp = video::FrameHeader::µSeconds{ 0 };
+	int Sequence   = INT_MAX;
+
+	return [=, &Timer](const video::FrameHeader & Header) mutable {
+		const auto Now     = steady_clock::now();
+		const auto Loose   = Header.Sequence_ == 0;
+		const auto Starts  = !Loose && Header.Sequence_ < Sequence;
+		const auto DueTime = Starts  ? Now
+		                     : Loose ? StartTime + Timestamp
+		                             : StartTime + Header.Timestamp_;
+		const auto Late    = Now - DueTime;
+		if (Starts || Loose)
+			StartTime = Now;
+		else if (Late > MaxLateness)
+			StartTime += Late;
+		Sequence  = Loose ? INT_MAX : Header.Sequence_; // a new one is next
+		Timestamp = Header.Timestamp_;
+		Timer.expires_at(DueTime);
+		return Late;
+	};
+}
+
+// frames which own their pixels are shared by all subscribers as they are,
+// others live only until the decoder moves on and are copied once
+
+static Payload makeShared(const video::Frame & Frame) {
+	const auto Owned = make_shared<const video::Frame>(Frame.owned());
+	const auto Bytes = Owned->Pixels_;
+	return { Frame.Header_, shared_ptr<const std::byte[]>(Owned, Bytes.data()),
+		     Bytes.size() };
+}
+
+// the packet a frame is decoded from as a payload of its own, shared with the
+// frame. Nothing if there is none
+
+static optional<Payload> makePacket(const video::Frame & Frame) {
+	const auto & Packet = Frame.Compressed_;
+	if (Packet.Bytes_.empty())
+		return nullopt;
+	auto Header         = Frame.Header_;
+	Header.Flags_       = static_cast<uint16_t>(video::Packet | Packet.Flags_);
+	Header.PayloadSize_ = Packet.Bytes_.size();
+	const auto Owner    = make_shared<const video::Buffer>(Packet.Buffer_);
+	return Payload{ Header,
+		            shared_ptr<const std::byte[]>(Owner, Packet.Bytes_.data()),
+		            Packet.Bytes_.size() };
+}
+
+//------------------------------------------------------------------------------
+// consecutive frames often differ in small regions only. Compare them tile by
+// tile and collect the changed tiles into rectangles
+
+static constexpr auto TileSize = 32;
+
+// true if the byte ranges differ, compared 16 bytes at a time
+static bool differs(const std::byte * Lhs, const std::byte * Rhs,
+                    size_t Size) noexcept {
+#if defined(__SSE2__) || defined(_M_X64)
+	for (; Size >= 16; Size -= 16, Lhs += 16, Rhs += 16) {
+		const auto L = _mm_loadu_si128(reinterpret_cast<const __m128i *>(Lhs));
+		const auto R = _mm_loadu_si128(reinterpret_cast<const __m128i *>(Rhs));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(L, R)) != 0xFFFF)
+			return true;
+	}
+#endif
+	return memcmp(Lhs, Rhs, Size) != 0;
+}
+
+// the delta from frame Before to frame After, nothing if not worth it. The
+// first frame of a sequence is always sent in full, clients may start anew
+// with it
+static optional<Payload> makeDelta(const Payload & Before,
+                                   const Payload & After) {
+	const auto & Header = After.Header_;
+	const auto & Base   = Before.Header_;
+	if (Header.empty() || Header.kind() != video::Full ||
+	    Header.Sequence_ <= Base.Sequence_ ||
+	    Base.kind() != video::Full || Header.Width_ != Base.Width_ ||
+	    Header.Height_ != Base.Height_ ||
+	    Header.LinePitch_ != Base.LinePitch_ ||
+	    Header.format() != Base.format() || Header.Width_ > UINT16_MAX ||
+	    Header.Height_ > UINT16_MAX) // beyond the reach of video::Rect
+		return nullopt;
+
+	size_t Offset    = 0;
+	size_t PixelSize = 4;
+	if (Header.format() == video::PAL8) {
+		if (differs(Before.Bytes_.get(), After.Bytes_.get(),
+		            video::PaletteBytes))
+			return nullopt;
+		Offset    = video::PaletteBytes;
+		PixelSize = 1;
+	}
+	const auto * Old   = Before.Bytes_.get() + Offset;
+	const auto * New   = After.Bytes_.get() + Offset;
+	const auto Pitch   = static_cast<size_t>(Header.LinePitch_);
+	const auto Width   = static_cast<int>(Header.Width_);
+	const auto Height  = static_cast<int>(Header.Height_);
+
+	const auto isDirty = [&](int x, int y, int h) {
+		const auto Bytes = min(TileSize, Width - x) * PixelSize;
+		for (const auto End = y + h; y < End; ++y) {
+			const auto Start = y * Pitch + x * PixelSize;
+			if (differs(Old + Start, New + Start, Bytes))
+				return true;
+		}
+		return false;
+	};
+
+	// runs of dirty tiles within a row of tiles become rectangles, which grow
+	// downwards as long as the row of tiles below has a run of equal extent
+	vector<video::Rect> Rects;
+	vector<size_t> Above;
+	for (int y = 0; y < Height; y += TileSize) {
+		const auto h = min(TileSize, Height - y);
+		vector<size_t> Here;
+		for (int x = 0; x < Width;) {
+			if (!isDirty(x, y, h)) {
+				x += TileSize;
+				continue;
+			}
+			auto End = x + TileSize;
+			while (End < Width && isDirty(End, y, h))
+				End += TileSize;
+			End = min(End, Width);
+
+			const video::Rect Run{ static_cast<uint16_t>(x),
+				                   static_cast<uint16_t>(y),
+				                   static_cast<uint16_t>(End - x),
+				                   static_cast<uint16_t>(h) };
+			const auto Extend = ranges::find_if(Above, [&](size_t i) {
+				return Rects[i].X_ == Run.X_ && Rects[i].Width_ == Run.Width_;
+			});
+			if (Extend != Above.end()) {
+				Rects[*Extend].Height_ += Run.Height_;
+				Here.push_back(*Extend);
+			} else {
+				Here.push_back(Rects.size());
+				Rects.push_back(Run);
+			}
+			x = End;
+		}
+		Above = std::move(Here);
+	}
+
+	auto Delta = Header;
+	if (Rects.empty()) {
+		Delta.Flags_       = video::Repeat;
+		Delta.PayloadSize_ = 0;
+		return Payload{ Delta, nullptr, 0 };
+	}
+
+	auto Size = sizeof(video::DeltaHeader) + Rects.size() * sizeof(video::Rect);
+	for (const auto & Rect : Rects)
+		Size += size_t{ Rect.Width_ } * Rect.Height_ * PixelSize;
+	if (Size >= After.Size_ / 4 * 3)
+		return nullopt;
+
+	auto Bytes = make_shared_for_overwrite<std::byte[]>(Size);
+	auto * Out = Bytes.get();
+	const video::DeltaHeader Info{
+		static_cast<uint32_t>(Rects.size()),
+		static_cast<uint32_t>(Size - sizeof(video::DeltaHeader))
+	};
+	Out = ranges::copy(asBytes(Info), Out).out;
+	Out = ranges::copy(as_bytes(span{ Rects }), Out).out;
+	for (const auto & Rect : Rects) {
+		const auto Bytes = Rect.Width_ * PixelSize;
+		pixels::copyRows(New + Rect.Y_ * Pitch + Rect.X_ * PixelSize, Pitch,
+		                 Out, Bytes, Bytes, Rect.Height_);
+		Out += Bytes * Rect.Height_;
+	}
+
+	Delta.Flags_       = video::Delta;
+	Delta.PayloadSize_ = Size;
+	return Payload{ Delta, std::move(Bytes), Size };
+}
+
+//------------------------------------------------------------------------------
+// payloads packed for peers which unpack them. Like the deltas, a payload is
+// packed once on the decode pool and shared by all subscribers
+
+static constexpr size_t MinPackable = 4096;
+
+// attach the packed payload, unless the payload is small or packing saves
+// less than a quarter. Packing gives up early on payloads which don't pack
+// well
+static void addPacked(Payload & Plain) {
+	if (Plain.Size_ < MinPackable)
+		return;
+	thread_local vector<std::byte> Space;
+	Space.resize(Plain.Size_ / 4 * 3);
+	const auto Element = Plain.Header_.format() == video::PAL8 ? 1u : 4u;
+	const auto Size    = packing::pack(Plain.bytes(), Element, Space);
+	if (Size == 0)
+		return;
+
+	auto Bytes = make_shared_for_overwrite<std::byte[]>(Size);
+	memcpy(Bytes.get(), Space.data(), Size);
+	auto Header = Plain.Header_;
+	Header.Flags_ = static_cast<uint16_t>(Header.Flags_ | video::Packed);
+	Header.PayloadSize_ = Size;
+	Plain.Packed_ =
+	    make_shared<const Payload>(Payload{ Header, std::move(Bytes), Size });
+}
+
+//------------------------------------------------------------------------------
+// peers which can't take indexed frames get them expanded to BGRA, the byte
+// order of the palette entries
+
+static Payload expandIndexed(const Payload & Indexed) {
+	const auto & Source = Indexed.Header_;
+	auto Header         = Source;
+	Header.Format_      = video::BGRA;
+	Header.LinePitch_   = Source.Width_ * 4;
+	Header.PayloadSize_ = Header.frameSize();
+
+	auto Bytes = make_shared_for_overwrite<std::byte[]>(Header.size());
+	array<uint32_t, video::PaletteEntries> Palette;
+	memcpy(Palette.data(), Indexed.Bytes_.get(), video::PaletteBytes);
+	const auto * Rows = Indexed.Bytes_.get() + video::PaletteBytes;
+	const auto Width  = static_cast<size_t>(Source.Width_);
+	for (int y = 0; y < Source.Height_; ++y)
+		pixels::expandPalette(Rows + static_cast<size_t>(y) * Source.LinePitch_,
+		                      Bytes.get() + y * Width * 4, Width, Palette);
+	return { Header, std::move(Bytes), Header.size() };
+}
+
+// peers which decode themselves take the packets of a stream from its start
+// on, and the decoded frames until then or after a gap. Deltas apply to the
+// decoded frames only. Peers which unpack take the packed payload if there is
+// one
+
+optional<Payload> SharedFrame::select(const video::wire::Hello & Peer,
+                                      PeerState & State) const {
+	using namespace video::wire;
+	if (!Peer.fits(Full_.Header_))
+		return nullopt;
+
+	if (Packet_ && Peer.has(Packets) && Peer.has(HeaderV2)) {
+		const auto Follows = State.Decoding_ && State.Previous_ + 1 == Id_;
+		if (Follows || (Packet_->Header_.Flags_ & video::NewStream)) {
+			State = { Id_, true };
+			return Packet_;
+		}
+	}
+
+	const auto Previous = State.Decoding_ ? uint64_t{ 0 } : State.Previous_;
+	auto Chosen = Full_.Header_.format() == video::PAL8 && !Peer.has(Indexed)
+	                  ? expandIndexed(Full_)
+	              : Peer.has(Deltas) ? after(Previous)
+	                                 : Full_;
+	if (!Peer.has(HeaderV2) && !fitsV1(Chosen.Header_))
+		return nullopt;
+	State = { Id_, false };
+	if (Chosen.Packed_ && Peer.has(Compression) && Peer.has(HeaderV2))
+		return *Chosen.Packed_;
+	return Chosen;
+}
+
+static atomic<uint64_t> FrameIds = 0;
+
+//------------------------------------------------------------------------------
+// decode a media source on the decode pool into a bounded queue of frames ahead
+// of their due time. Any idle thread of the pool picks up the next decode step
+// of any stream, but never more than one at a time per stream. The network
+// side only ever awaits frames which are ready to go
+
+class Lookahead : public enable_shared_from_this<Lookahead> {
+public:
+	[[nodiscard]] Lookahead(asio::any_io_executor Consumer,
+	                        asio::any_io_executor Decoder, filesystem::path Source)
+	: Decoder_{ std::move(Decoder) }
+	, Source_{ std::move(Source) }
+	, Ready_{ std::move(Consumer), steady_clock::time_point::max() } {}
+
+	void start() {
+		{
+			const lock_guard Lock(Mutex_);
+			Pumping_ = true;
+		}
+		resume();
+	}
+	void stop() {
+		const lock_guard Lock(Mutex_);
+		Stopped_ = true;
+	}
+
+	// precondition: runs on the consumer executor
+	asio::awaitable<optional<SharedFrame>> pop();
+
+private:
+	using tFrames = generator<video::Frame>;
+
+	static constexpr size_t Depth = 8;
+
+	void resume() {
+		asio::post(Decoder_, [Self = shared_from_this()] { Self->pump(); });
+	}
+	void wakeup() {
+		asio::post(Ready_.get_executor(),
+		           [Self = shared_from_this()] { Self->Ready_.cancel(); });
+	}
+	void pump();
+
+	asio::any_io_executor Decoder_;
+	filesystem::path Source_;
+	tTimer Ready_;
+
+	// touched by the one active decode step only
+	optional<tFrames> Frames_;
+	optional<ranges::iterator_t<tFrames>> Frame_;
+	optional<Payload> Previous_;
+
+	mutex Mutex_;
+	deque<SharedFrame> Queue_;
+	bool Pumping_ = false;
+	bool Stopped_ = false;
+};
+
+// precondition: runs on the decode pool
+// decode until the queue is full, then park until the consumer makes room
+
+void Lookahead::pump() {
+	for (;;) {
+		{
+			const lock_guard Lock(Mutex_);
+			if (Stopped_ || Queue_.size() >= Depth) {
+				Pumping_ = false;
+				return;
+			}
+		}
+		if (!Frames_) {
+			Frames_.emplace(videodecoder::makeFrames(Source_, Decoder_));
+			Frame_.emplace(Frames_->begin());
+		} else {
+			++*Frame_;
+		}
+
+		const bool End = *Frame_ == Frames_->end();
+		SharedFrame Frame;
+		if (!End) {
+			Frame.Full_   = makeShared(**Frame_);
+			Frame.Packet_ = makePacket(**Frame_);
+			Frame.Id_     = ++FrameIds;
+			if (Previous_)
+				Frame.Delta_ = makeDelta(*Previous_, Frame.Full_);
+			Previous_ = Frame.Full_;
+			addPacked(Frame.Full_);
+			if (Frame.Delta_)
+				addPacked(*Frame.Delta_);
+		}
+		{
+			const lock_guard Lock(Mutex_);
+			if (End) {
+				Stopped_ = true;
+				Pumping_ = false;
+			} else {
+				Queue_.push_back(std::move(Frame));
+			}
+		}
+		wakeup();
+		if (End)
+			return;
+	}
+}
+
+asio::awaitable<optional<SharedFrame>> Lookahead::pop() {
+	for (;;) {
+		optional<SharedFrame> Frame;
+		bool Resume = false;
+		{
+			const lock_guard Lock(Mutex_);
+			if (!Queue_.empty()) {
+				Frame = std::move(Queue_.front());
+				Queue_.pop_front();
+				Resume   = !Pumping_ && !Stopped_;
+				Pumping_ = Pumping_ || Resume;
+			} else if (Stopped_) {
+				co_return nullopt;
+			}
+		}
+		if (Resume)
+			resume();
+		if (Frame)
+			co_return Frame;
+		co_await Ready_.async_wait(); // woken up by cancellation only
+	}
+}
+
+//------------------------------------------------------------------------------
+// replay a frame archive endlessly. The payloads are shared straight from the
+// memory mapping of the archive, the next few frames are hinted to be paged in
+// ahead of their due time
+
+class Replay {
+public:
+	[[nodiscard]] explicit Replay(archive::Reader Archive)
+	: Archive_{ std::move(Archive) } {}
+
+	asio::awaitable<optional<SharedFrame>> pop() {
+		if (Archive_.empty())
+			co_return nullopt;
+		const auto & Frame = Archive_[Next_];
+		Archive_.willNeed((Next_ + Ahead) % Archive_.size());
+		Next_ = (Next_ + 1) % Archive_.size();
+
+		SharedFrame Shared{ .Full_ = share(Frame.Full_), .Id_ = ++FrameIds };
+		if (Frame.Delta_)
+			Shared.Delta_ = share(*Frame.Delta_);
+		co_return Shared;
+	}
+
+private:
+	static constexpr size_t Ahead = 8;
+
+	Payload share(const archive::Record & Data) const {
+		return { Data.Header_,
+			     shared_ptr<const std::byte[]>(Archive_.mapping(),
+			                                   Data.Bytes_.data()),
+			     Data.Bytes_.size() };
+	}
+
+	archive::Reader Archive_;
+	size_t Next_ = 0;
+};
+
+// the packer runs the encoders of the channel once and ahead of time
+
+bool pack(const filesystem::path & Directory,
+          const filesystem::path & Archive) {
+	archive::Writer Packer(Archive);
+	optional<Payload> Previous;
+	for (const auto & Frame : videodecoder::decodeDirectory(Directory)) {
+		const auto Full = makeShared(Frame);
+		optional<archive::Record> Delta;
+		if (const auto Changes = Previous ? makeDelta(*Previous, Full)
+		                                  : nullopt)
+			Delta = archive::Record{ Changes->Header_, Changes->bytes() };
+		Packer.add({ Full.Header_, Full.bytes() }, Delta);
+		Previous = Full;
+	}
+	return Packer.finish();
+}
+
+//------------------------------------------------------------------------------
+
+Subscription::Subscription(asio::any_io_executor Executor)
+: Signal_{ std::move(Executor), steady_clock::time_point::max() } {}
+
+asio::awaitable<optional<SharedFrame>> Subscription::next() {
+	while (!Latest_ && !Closed_)
+		co_await Signal_.async_wait(); // woken up by cancellation only
+	if (Closed_)
+		co_return nullopt;
+	co_return exchange(Latest_, nullopt);
+}
+
+void Subscription::close() {
+	Closed_ = true;
+	Signal_.cancel();
+}
+
+// precondition: runs on the executor of the subscriber
+void Subscription::deliver(SharedFrame Frame) {
+	if (Closed_)
+		return;
+	if (Latest_)
+		++Skipped_;
+	Latest_ = std::move(Frame); // latest frame wins
+	Signal_.cancel();
+}
+
+//------------------------------------------------------------------------------
+
+Channel::Channel(asio::any_io_executor Executor, asio::any_io_executor Decoder,
+                 filesystem::path Source, milliseconds MaxLateness)
+: Executor_{ std::move(Executor) }
+, Decoder_{ std::move(Decoder) }
+, Source_{ std::move(Source) }
+, MaxLateness_{ MaxLateness } {}
+
+shared_ptr<Subscription> Channel::subscribe(asio::any_io_executor Executor) {
+	auto Subscriber = make_shared<Subscription>(std::move(Executor));
+
+	const lock_guard Lock(Mutex_);
+	Subscribers_.push_back(Subscriber);
+	if (!Running_) {
+		Running_ = true;
+		co_spawn(Executor_, broadcast(shared_from_this()), asio::detached);
+	}
+	return Subscriber;
+}
+
+Lateness Channel::lateness() {
+	const lock_guard Lock(Mutex_);
+	return Lateness_;
+}
+
+// the bucket of the lateness histogram a frame goes into
+static size_t bucketOf(steady_clock::duration Late) noexcept {
+	if (Late <= 0s)
+		return 0;
+	const auto Millis = duration_cast<milliseconds>(Late).count();
+	return min<size_t>(bit_width(static_cast<uint64_t>(Millis)) + 1,
+	                   Lateness::Buckets - 1);
+}
+
+// publish the frames of a source at their due time, false after the last
+// subscriber has gone. Subscribers take the frame after a skipped one in full
+
+template <typename Source>
+asio::awaitable<bool> Channel::relay(Source & Frames) {
+	tTimer Timer(Executor_);
+	auto DueTime = makeTimedBarrier(Timer, MaxLateness_);
+
+	while (const auto Frame = co_await Frames.pop()) {
+		const auto Late = DueTime(Frame->Full_.Header_);
+		const auto Skip = Late > MaxLateness_;
+		{
+			const lock_guard Lock(Mutex_);
+			++Lateness_.Frames_[bucketOf(Late)];
+			Lateness_.Skipped_ += Skip;
+		}
+		if (Skip)
+			continue;
+		co_await Timer.async_wait();
+		if (!publish(*Frame))
+			co_return false;
+	}
+	co_return true;
+}
+
+// opening an archive checks all of its records, which pages in their headers.
+// That takes a while from cold storage and belongs on the decode pool
+
+static asio::awaitable<optional<archive::Reader>>
+openArchive(filesystem::path File) {
+	co_return archive::Reader::open(File);
+}
+
+// the one and only decode pipeline of this channel
+
+asio::awaitable<void> Channel::broadcast(shared_ptr<Channel> Self) {
+	if (auto Archive = co_await co_spawn(
+	        Self->Decoder_, openArchive(Self->Source_), asio::use_awaitable)) {
+		Replay Frames(std::move(*Archive));
+		if (!co_await Self->relay(Frames))
+			co_return;
+	} else {
+		const auto Frames = make_shared<Lookahead>(
+		    Self->Executor_, Self->Decoder_, Self->Source_);
+		Frames->start();
+		if (!co_await Self->relay(*Frames)) {
+			Frames->stop();
+			co_return;
+		}
+	}
+
+	// the media source has dried up, the subscribers see the end of it
+	const lock_guard Lock(Self->Mutex_);
+	Self->Running_ = false;
+	for (const auto & Weak : exchange(Self->Subscribers_, {})) {
+		if (auto Subscriber = Weak.lock())
+			asio::post(Subscriber->get_executor(),
+			           [Subscriber] { Subscriber->close(); });
+	}
+}
+
+// returns false after the last subscriber has gone
+
+bool Channel::publish(const SharedFrame & Frame) {
+	const lock_guard Lock(Mutex_);
+	erase_if(Subscribers_, [](const auto & Subscriber) {
+		return Subscriber.expired();
+	});
+	if (Subscribers_.empty()) {
+		Running_ = false;
+		return false;
+	}
+
+	for (const auto & Weak : Subscribers_) {
+		if (auto Subscriber = Weak.lock())
+			asio::post(Subscriber->get_executor(),
+			           [Subscriber, Frame] { Subscriber->deliver(Frame); });
+	}
+	return true;
+}
+} // namespace broadcast
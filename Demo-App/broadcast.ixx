@@ -0,0 +1,153 @@
+﻿module;
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+export module video.broadcast;
+import asio;
+import net.types;
+import video;
+
+using namespace std; // bad practice - only for presentation!
+
+// a broadcast channel: one decode pipeline per media source, fanning out the
+// frames to every subscribed connection
+
+namespace broadcast {
+
+// a frame header plus the payload that goes with it on the wire
+
+export struct Payload {
+	video::FrameHeader Header_;
+	shared_ptr<const std::byte[]> Bytes_;
+	size_t Size_ = 0;
+	shared_ptr<const Payload> Packed_; // the same packed, if worth it
+
+	[[nodiscard]] video::tPixels bytes() const noexcept {
+		return { Bytes_.get(), Size_ };
+	}
+};
+
+// what a peer has been sent so far
+export struct PeerState {
+	uint64_t Previous_ = 0;     // the frame sent last
+	bool Decoding_     = false; // following the packets of the current stream
+};
+
+// a frame that owns its payloads, shareable among any number of subscribers
+// subscribers which have sent the frame right before may send the (much
+// smaller) delta instead of the full frame. Peers which decode themselves
+// take the compressed packet as long as they follow the stream without gaps
+
+export struct SharedFrame {
+	Payload Full_;
+	optional<Payload> Delta_;
+	optional<Payload> Packet_;
+	uint64_t Id_ = 0; // frames are numbered consecutively, starting at 1
+
+	[[nodiscard]] const Payload & after(uint64_t Previous) const noexcept {
+		return Delta_ && Previous != 0 && Previous + 1 == Id_ ? *Delta_ : Full_;
+	}
+
+	// the cheapest payload for a peer with the given capabilities, nothing if
+	// the peer can't take this frame at all. The state of the peer is updated
+	// to the payload chosen
+	[[nodiscard]] optional<Payload> select(const video::wire::Hello & Peer,
+	                                       PeerState & State) const;
+};
+
+// the receiving end of a channel
+// a single-slot mailbox that always holds the most recent frame. Slow
+// subscribers skip the frames they were too slow for, they never hold back
+// the channel or the other subscribers
+
+export class Subscription {
+public:
+	[[nodiscard]] explicit Subscription(asio::any_io_executor Executor);
+
+	// wait for the next frame not seen yet, nothing if closed
+	asio::awaitable<optional<SharedFrame>> next();
+	void close();
+
+	// the number of frames replaced by a newer one before they were taken
+	[[nodiscard]] uint64_t skipped() const noexcept {
+		return Skipped_;
+	}
+
+	[[nodiscard]] asio::any_io_executor get_executor() const {
+		return Signal_.get_executor();
+	}
+
+private:
+	friend class Channel;
+	void deliver(SharedFrame Frame);
+
+	net::tTimer Signal_;
+	optional<SharedFrame> Latest_;
+	uint64_t Skipped_ = 0;
+	bool Closed_      = false;
+};
+
+// how late the frames of a channel were when they were due: bucket 0 counts
+// the frames on time, bucket i the frames late by less than 2^(i-1) ms, and
+// the last bucket all later ones. Frames late beyond the maximum lateness of
+// the channel are skipped
+
+export struct Lateness {
+	static constexpr size_t Buckets = 12;
+
+	array<uint64_t, Buckets> Frames_{};
+	uint64_t Skipped_ = 0;
+};
+
+// the sending end of a channel
+// the decode pipeline is started with the first subscriber and brought down
+// after the last subscriber has gone. All blocking decoder calls are made on
+// the executor of a decode pool, the channel executor just paces the frames
+// a source which is a frame archive rather than a media directory is replayed
+// from the archive endlessly, without any decoding
+// a channel running behind schedule doesn't burst out the overdue frames.
+// It skips the frames which are late beyond MaxLateness and starts over on
+// schedule from there
+
+export class Channel : public enable_shared_from_this<Channel> {
+public:
+	[[nodiscard]] Channel(asio::any_io_executor Executor,
+	                      asio::any_io_executor Decoder,
+	                      filesystem::path Source,
+	                      chrono::milliseconds MaxLateness);
+
+	// subscribers join on the next frame
+	[[nodiscard]] shared_ptr<Subscription>
+	subscribe(asio::any_io_executor Executor);
+
+	// the lateness of the frames so far
+	[[nodiscard]] Lateness lateness();
+
+private:
+	static asio::awaitable<void> broadcast(shared_ptr<Channel> Self);
+	template <typename Source>
+	asio::awaitable<bool> relay(Source & Frames);
+	bool publish(const SharedFrame & Frame);
+
+	asio::any_io_executor Executor_;
+	asio::any_io_executor Decoder_;
+	filesystem::path Source_;
+	chrono::milliseconds MaxLateness_;
+
+	mutex Mutex_;
+	vector<weak_ptr<Subscription>> Subscribers_;
+	Lateness Lateness_;
+	bool Running_ = false;
+};
+
+// pack the frames of all media files in a directory into a frame archive, in
+// the payloads the channel would publish. False if that fails
+export bool pack(const filesystem::path & Directory,
+                 const filesystem::path & Archive);
+} // namespace broadcast
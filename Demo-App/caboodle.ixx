@@ -6,6 +6,7 @@ module;
 
 #include <filesystem>
 #include <string>
+#include <thread>
 #include <tuple>
 #include <iostream>
 
@@ -28,6 +29,14 @@ namespace caboodle {
 		return std::tuple{
 			Option["media"].as<std::string>(),
 			Option["server"].as<std::string>(),
+			Option["threads"].as<unsigned>(),
+			Option["cache"].as<unsigned>(),
+			Option["network"].as<bool>(),
+			Option["catalog"].as<std::string>(),
+			Option["pack"].as<std::string>(),
+			Option["lateness"].as<unsigned>(),
+			Option["benchmark"].as<bool>(),
+			Option["software"].as<bool>(),
 		};
 	}
 
@@ -115,8 +124,20 @@ namespace caboodle {
 		// clang-format off
 		OptionsDescription.add_options()
 			("help", "produce help message")
-			("media", po::value<std::string>()->default_value("media"), "media directory")
+			("media", po::value<std::string>()->default_value("media"), "media directory or frame archive")
 			("server", po::value<std::string>()->default_value(""), "server name or ip")
+			("threads", po::value<unsigned>()->default_value(std::thread::hardware_concurrency()),
+			 "server threads, 0 = share the main thread")
+			("cache", po::value<unsigned>()->default_value(256), "frame cache size in MiB")
+			("network", po::bool_switch(), "receive over the network even from the server in this process")
+			("catalog", po::value<std::string>()->default_value(""),
+			 "keep the media catalog in this file across runs")
+			("pack", po::value<std::string>()->default_value(""),
+			 "pack the media directory into this frame archive and quit")
+			("lateness", po::value<unsigned>()->default_value(250),
+			 "skip frames which are late by more than this many ms")
+			("benchmark", po::bool_switch(), "time the pixel kernels against SDL and quit")
+			("software", po::bool_switch(), "paint into the window without a GPU renderer")
 			;
 		// clang-format on
 		po::positional_options_description PositionalOptions;
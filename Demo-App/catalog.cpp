@@ -0,0 +1,171 @@
+module;
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <vector>
+
+module media.catalog;
+
+using namespace std; // bad practice - only for presentation!
+
+namespace fs = std::filesystem;
+
+namespace catalog {
+
+FileStamp getStamp(const fs::path & Path) {
+	error_code Error;
+	const auto Modified = fs::last_write_time(Path, Error);
+	if (Error)
+		return {};
+	const auto Size = fs::file_size(Path, Error);
+	if (Error)
+		return {};
+	return { static_cast<int64_t>(Modified.time_since_epoch().count()), Size };
+}
+
+shared_ptr<const Entry> Catalog::find(const fs::path & Path,
+                                      const FileStamp & Stamp) const {
+	const shared_lock Lock(Mutex_);
+	const auto Iter = Entries_.find(Path.native());
+	if (Iter == Entries_.end() || Iter->second->Stamp_ != Stamp)
+		return {};
+	return Iter->second;
+}
+
+void Catalog::insert(const fs::path & Path, Entry Info) {
+	auto Shared = make_shared<const Entry>(std::move(Info));
+	const lock_guard Lock(Mutex_);
+	Entries_.insert_or_assign(Path.native(), std::move(Shared));
+	Dirty_ = true;
+}
+
+//------------------------------------------------------------------------------
+// the catalog file is a plain dump in the byte order of the machine. A file
+// from a machine with a different byte order or from a different version is
+// ignored, the catalog is rebuilt then
+//
+//   header: magic, version, number of entries
+//   entry:  path length, path (native characters), stamp, playable, codec,
+//           width, height, duration, number of frames, timestamps
+
+static constexpr uint32_t Magic   = 0x47494643; // "GIFC"
+static constexpr uint32_t Version = 1;
+
+namespace {
+template <typename T>
+	requires is_trivially_copyable_v<T>
+void write(ostream & Out, const T & Value) {
+	Out.write(reinterpret_cast<const char *>(&Value), sizeof(T));
+}
+template <typename T>
+	requires is_trivially_copyable_v<T>
+void write(ostream & Out, const T * Values, size_t Count) {
+	Out.write(reinterpret_cast<const char *>(Values),
+	          static_cast<streamsize>(Count * sizeof(T)));
+}
+
+template <typename T>
+	requires is_trivially_copyable_v<T>
+bool read(istream & In, T & Value) {
+	return static_cast<bool>(
+	    In.read(reinterpret_cast<char *>(&Value), sizeof(T)));
+}
+template <typename T>
+	requires is_trivially_copyable_v<T>
+bool read(istream & In, T * Values, size_t Count) {
+	const auto Bytes = static_cast<streamsize>(Count * sizeof(T));
+	return static_cast<bool>(In.read(reinterpret_cast<char *>(Values), Bytes));
+}
+} // namespace
+
+bool Catalog::load(const fs::path & File) {
+	ifstream In(File, ios::binary);
+	uint32_t Header[3];
+	if (!read(In, Header, 3) || Header[0] != Magic || Header[1] != Version)
+		return false;
+
+	// sanity limits against corrupted files
+	constexpr uint32_t MaxPath   = 32 * 1024;
+	constexpr uint32_t MaxFrames = 1 << 24;
+
+	decltype(Entries_) Entries;
+	for (uint32_t Count = Header[2]; Count > 0; --Count) {
+		uint32_t Length;
+		if (!read(In, Length) || Length > MaxPath)
+			return false;
+		tKey Path(Length, {});
+		Entry Info;
+		uint8_t Playable;
+		uint32_t Frames;
+		if (!read(In, Path.data(), Length) || !read(In, Info.Stamp_) ||
+		    !read(In, Playable) || !read(In, Info.Codec_) ||
+		    !read(In, Info.Width_) || !read(In, Info.Height_) ||
+		    !read(In, Info.Duration_) || !read(In, Frames) ||
+		    Frames > MaxFrames)
+			return false;
+		Info.Playable_ = Playable != 0;
+		Info.Timestamps_.resize(Frames);
+		if (!read(In, Info.Timestamps_.data(), Frames))
+			return false;
+		Entries.insert_or_assign(std::move(Path),
+		                         make_shared<const Entry>(std::move(Info)));
+	}
+
+	const lock_guard Lock(Mutex_);
+	Entries_ = std::move(Entries);
+	Dirty_   = false;
+	return true;
+}
+
+// written to a temporary file first, which replaces the catalog file when
+// complete
+bool Catalog::save(const fs::path & File) {
+	decltype(Entries_) Entries;
+	{
+		const lock_guard Lock(Mutex_);
+		if (!Dirty_)
+			return true;
+		Entries = Entries_;
+		Dirty_  = false;
+	}
+	// keep the changes for the next attempt
+	const auto retry = [this] {
+		const lock_guard Lock(Mutex_);
+		Dirty_ = true;
+		return false;
+	};
+
+	auto Temporary = File;
+	Temporary += ".tmp";
+	{
+		ofstream Out(Temporary, ios::binary | ios::trunc);
+		const uint32_t Header[3] = { Magic, Version,
+			                         static_cast<uint32_t>(Entries.size()) };
+		write(Out, Header, 3);
+		for (const auto & [Path, Info] : Entries) {
+			write(Out, static_cast<uint32_t>(Path.size()));
+			write(Out, Path.data(), Path.size());
+			write(Out, Info->Stamp_);
+			write(Out, static_cast<uint8_t>(Info->Playable_));
+			write(Out, Info->Codec_);
+			write(Out, Info->Width_);
+			write(Out, Info->Height_);
+			write(Out, Info->Duration_);
+			write(Out, static_cast<uint32_t>(Info->frames()));
+			write(Out, Info->Timestamps_.data(), Info->frames());
+		}
+		if (!Out.flush())
+			return retry();
+	}
+	error_code Error;
+	fs::rename(Temporary, File, Error);
+	return !Error || retry();
+}
+} // namespace catalog
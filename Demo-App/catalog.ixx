@@ -0,0 +1,65 @@
+module;
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
+
+export module media.catalog;
+
+using namespace std; // bad practice - only for presentation!
+
+// what is known about the media files, in memory and on disk
+// files are identified by their path, entries are valid as long as the
+// modification time and the size of the file stay the same
+
+namespace catalog {
+
+export struct FileStamp {
+	int64_t Modified_ = 0; // ticks of the file clock
+	uint64_t Size_    = 0;
+
+	[[nodiscard]] bool operator==(const FileStamp &) const noexcept = default;
+};
+
+// the stamp of a file, all zero if there is no such file
+export [[nodiscard]] FileStamp getStamp(const filesystem::path & Path);
+
+export struct Entry {
+	FileStamp Stamp_;
+	bool Playable_    = false;
+	int32_t Codec_    = 0; // AVCodecID
+	int32_t Width_    = 0;
+	int32_t Height_   = 0;
+	int64_t Duration_ = 0;       // microseconds
+	vector<int64_t> Timestamps_; // microseconds, one per frame in decode order
+
+	[[nodiscard]] size_t frames() const noexcept {
+		return Timestamps_.size();
+	}
+};
+
+// any number of readers may look up entries concurrently
+
+export class Catalog {
+public:
+	// the entry of a file if it is still valid
+	[[nodiscard]] shared_ptr<const Entry> find(const filesystem::path & Path,
+	                                           const FileStamp & Stamp) const;
+	void insert(const filesystem::path & Path, Entry Info);
+
+	// replace the contents by those of a catalog file, false if unreadable
+	bool load(const filesystem::path & File);
+	// write the contents to a catalog file if there are changes since the
+	// last load or save
+	bool save(const filesystem::path & File);
+
+private:
+	using tKey = filesystem::path::string_type;
+
+	mutable shared_mutex Mutex_;
+	unordered_map<tKey, shared_ptr<const Entry>> Entries_;
+	bool Dirty_ = false;
+};
+} // namespace catalog
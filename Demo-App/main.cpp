@@ -2,36 +2,101 @@
 The server
 
  - waits for clients to connect at any of a list of given endpoints
- - when a client connects, observes a given directory for all files in there
-   repeating this endlessly
- - filters all GIF files which contain a video
- - decodes each video file into individual video frames
- - sends each frame at the correct time to the client
+ - serves the clients from a given number of threads, each with an io_context
+   of its own. A client stays with the thread it was accepted by
+ - observes a given directory for all files in there repeating this endlessly
+   as long as there is at least one client connected. All clients share this
+   one observation, decoding, and timing
+ - filters all GIF files which contain a video, and remembers which ones do
+   in a catalog that is probed in parallel at startup and optionally kept
+   across runs
+ - follows the changes to the directory as they happen, and waits for
+   changes rather than spinning if there is nothing to play
+ - reads the video files through memory mappings which are shared by all
+   readers of the same file
+ - alternatively plays a frame archive, which holds the frames of a media
+   directory packed ahead of time in the very form they are sent in. These
+   go from the memory mapping of the archive straight to the network
+ - decodes each video file into individual video frames on a pool of decoder
+   threads, a few frames ahead of time
+ - opens the next few files and decodes their first frames in the background
+   while the current file is playing, so there are no gaps between files
+ - sends frames with no more than 256 colours as palette plus indices
+ - sends just the changed rectangles if a frame differs little from the one
+   before, or nothing but the header if they are equal
+ - keeps the decoded frames of the most recently played files in memory as
+   long as the files don't change
+ - learns from a handshake with each client what it is capable of, and
+   sends in the cheapest encoding within these limits
+ - forwards the compressed packets of the video files to clients which
+   decode them themselves, from the start of a file on
+ - packs the frames losslessly for clients which unpack them, once per frame
+   for all clients
+ - sends each frame at the correct time to the client, with a compact
+   header for frames that fit the original protocol and an extended header
+   for larger frames
+ - skips the frames which are overdue by too much if it falls behind
+   schedule rather than bursting them out, and logs how late the frames were
+ - skips frames for clients which can't keep up rather than disconnecting
+   them, unless they stay behind for seconds, and logs the frames skipped
  - sends filler frames if there happen to be no GIF files to process
 
 The client
 
- - tries to connect to any of a list of given server endpoints
- - receives video frames from the network connection
+ - takes the video frames directly from the server if it is part of the
+   same process, sharing them rather than copying them over the network
+ - otherwise tries to connect to any of a list of given server endpoints
+ - tells the server what it is capable of
+ - receives video frames from the network connection on a thread of its
+   own, in either header version, unpacks the packed ones and decodes the
+   compressed packets among them
+ - receives the frames right into a few frame buffers which the GUI thread
+   takes them from, and shows only the newest of the frames waiting
+ - uploads the pixels into textures of the same format, converting indexed
+   frames only
+ - paints the frames right into the window surface, converted and scaled by
+   its own pixel kernels, if there is no GPU renderer or if asked to do so
+ - reuses the textures of the most recent frame geometries and formats,
+   and renders only if the picture changed
+ - neither converts nor renders frames while the window is hidden or
+   minimized, but keeps receiving them
  - presents the video frames in a reasonable manner in a GUI window
 
 The application
 
+ - packs the media directory into a frame archive if asked to do so
+ - times its pixel kernels against SDL if asked to do so
  - performs a clean shutdown from all inputs that the user can interact with
  - handles timeouts and errors properly and performs a clean shutdown
 ==============================================================================*/
 
+#include <algorithm>
+#include <array>
 #include <chrono>
+#include <condition_variable>
 #include <coroutine>
+#include <cstddef>
 #include <csignal>
 #include <cstdint>
+#include <cstring>
+#include <deque>
 #include "__std_expected.hpp"
 #include <filesystem>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <random>
 #include <span>
 #include <stop_token>
 #include <string>
 #include <string_view>
 #include <system_error>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#	include <sys/socket.h>
+#endif
 
 #include "c_resource.hpp"
 
@@ -40,7 +105,10 @@ import asio;
 import net.types;
 import sdl;
 import video;
+import video.broadcast;
 import video.decoder;
+import video.packing;
+import video.pixels;
 import print;
 
 using namespace std;         // bad practice - only for presentation!
@@ -125,6 +193,19 @@ void _close(T & Obj) {
 		static_assert(is_fundamental_v<remove_cv_t<T>>);
 }
 
+// a stop may be requested from any thread, but io objects must be closed on
+// the thread running their executor. By then, the objects may be gone already
+
+template <typename F>
+struct Assassin {
+	shared_ptr<bool> Alive_;
+	stop_callback<F> Callback_;
+
+	~Assassin() {
+		*Alive_ = false;
+	}
+};
+
 template <typename S, typename T, typename... Ts>
 [[nodiscard]] auto killMe(S & Stop, T & Obj, Ts &... Objs) {
 	stop_token Token;
@@ -135,9 +216,16 @@ template <typename S, typename T, typename... Ts>
 	else
 		static_assert(is_void_v<S>, "gimme a break!");
 
-	return stop_callback{ std::move(Token), [&] {
-		                     (_close(Obj), ..., _close(Objs));
-		                 } };
+	auto Alive = make_shared<bool>(true);
+	auto Kill  = [&, Alive] {
+		asio::post(Obj.get_executor(), [&, Alive] {
+			if (*Alive)
+				(_close(Obj), ..., _close(Objs));
+		});
+	};
+	return Assassin<decltype(Kill)>{
+		Alive, stop_callback<decltype(Kill)>{ std::move(Token), std::move(Kill) }
+	};
 }
 
 } // namespace
@@ -145,74 +233,230 @@ template <typename S, typename T, typename... Ts>
 // server
 namespace {
 
-auto makeTimedBarrier(tTimer & Timer) {
-	auto StartTime = steady_clock::now();
-	auto Timestamp = video::FrameHeader::µSeconds{ 0 };
-	int Sequence   = INT_MAX;
-
-	return [=, &Timer](const video::Frame & Frame) mutable {
-		const auto & Header = Frame.Header_;
-		Timer.expires_at(StartTime + (Header.Sequence_ != 0 ? Header.Timestamp_
-		                                                    : Timestamp));
-		if (Header.Sequence_ == 0 ||
-		    Header.Sequence_ < Sequence) // start of frame sequence
-			StartTime = steady_clock::now();
-		Sequence  = Header.Sequence_;
-		Timestamp = Header.Timestamp_;
-		return Timer.async_wait();
-	};
+// a client says hello right after connecting. Clients which don't within a
+// short while are taken for clients of the first protocol version
+
+asio::awaitable<video::wire::Hello> receiveHello(tSocket & Socket,
+                                                 tTimer & Timer) {
+	using namespace video::wire;
+	array<std::byte, MaxHelloSize> Wire;
+	const auto Prefix = span{ Wire }.first<HelloSize>();
+	Timer.expires_after(250ms);
+	if (!(co_await receiveFrom(Socket, Timer, Prefix) == HelloSize))
+		co_return Hello{};
+	const auto Size = helloSize(Prefix);
+	if (Size == 0)
+		co_return Hello{};
+	if (Size > HelloSize) { // skip the parts of future protocol versions
+		const auto Rest = span{ Wire }.subspan(HelloSize, Size - HelloSize);
+		if (!(co_await receiveFrom(Socket, Timer, Rest) == Rest.size()))
+			co_return Hello{};
+	}
+	co_return decodeHello(Prefix);
 }
 
 // the connection object implemented as a coroutine on the heap
 // will be brought down by internal events or from the outside using a
 // stop_token
+// the connection subscribes to the broadcast channel of its media source and
+// sends whatever frame is the latest one when it is ready to send, in the
+// cheapest encoding the client is capable of
+// a send that takes longer than SendDeadline is late, and the frames published
+// in the meantime are skipped. Late sends are never cut off, that would tear
+// the stream apart. Only a client whose sends stay late for MaxLateness in a
+// row is disconnected, short hiccups of the network cost frames only
+
+static constexpr auto SendDeadline = 100ms;
+static constexpr auto MaxLateness  = 3s;
+
+// what happened to the frames of a connection, logged when it goes down
+struct SendStats {
+	uint64_t Sent_    = 0;
+	uint64_t Skipped_ = 0; // replaced by newer frames while sending
+	uint64_t Late_    = 0; // sends beyond their deadline
+	uint64_t Unfit_   = 0; // frames the client can't take
+};
 
 asio::awaitable<void> startStreaming(tSocket Socket, stop_token Stop,
-                                     fs::path Source) {
+                                     shared_ptr<broadcast::Channel> Channel) {
 	tTimer Timer(Socket.get_executor());
-	const auto _ = killMe(Stop, Socket, Timer);
-	auto DueTime = makeTimedBarrier(Timer);
-
-	for (const auto & Frame : videodecoder::makeFrames(std::move(Source))) {
-		co_await DueTime(Frame);
-
-		auto Buffers = SendBuffers<2>{ buffer(asBytes(Frame.Header_)),
-			                           buffer(Frame.Pixels_) };
-		Timer.expires_after(100ms);
+	const auto Subscription = Channel->subscribe(Socket.get_executor());
+	const auto _            = killMe(Stop, Socket, Timer, *Subscription);
+	error_code Error;
+	const auto Peer   = Socket.remote_endpoint(Error);
+	const auto Client = co_await receiveHello(Socket, Timer);
+
+	broadcast::PeerState Sent;
+	SendStats Stats;
+	optional<steady_clock::time_point> LateSince;
+	while (const auto Frame = co_await Subscription->next()) {
+		const auto Payload = Frame->select(Client, Sent);
+		if (!Payload) {
+			++Stats.Unfit_;
+			continue;
+		}
+		const auto Header = video::wire::encode(Payload->Header_);
+		auto Buffers      = SendBuffers<2>{ buffer(Header.bytes()),
+			                                buffer(Payload->bytes()) };
+		const auto Start  = steady_clock::now();
+		Timer.expires_at(max(Start + SendDeadline,
+		                     LateSince.value_or(Start) + MaxLateness));
 		if (!co_await sendTo(Socket, Timer, Buffers) || Stop.stop_requested())
 			break;
+		++Stats.Sent_;
+		if (steady_clock::now() - Start <= SendDeadline) {
+			LateSince.reset();
+		} else {
+			++Stats.Late_;
+			if (!LateSince)
+				LateSince = Start;
+		}
+	}
+	Stats.Skipped_ = Subscription->skipped();
+	println("client {}:{} gone, frames sent {}, skipped {}, late {}, unfit {}",
+	        Peer.address().to_string(), Peer.port(), Stats.Sent_,
+	        Stats.Skipped_, Stats.Late_, Stats.Unfit_);
+}
+
+// the lateness histogram of the channel, one line per bucket in use
+
+void logLateness(const broadcast::Lateness & Late) {
+	const auto & Frames = Late.Frames_;
+	if (Frames[0] > 0)
+		println("frames on time {}", Frames[0]);
+	for (size_t i = 1; i + 1 < Frames.size(); ++i)
+		if (Frames[i] > 0)
+			println("frames late < {} ms {}", 1u << (i - 1), Frames[i]);
+	if (Frames.back() > 0)
+		println("frames late >= {} ms {}", 1u << (Frames.size() - 3),
+		        Frames.back());
+	println("frames skipped {}", Late.Skipped_);
+}
+
+//------------------------------------------------------------------------------
+// the server runs on a number of reactors, i.e. io_contexts each of them run by
+// a thread of its own. Without any reactor threads, the server shares the io
+// context of the main thread
+
+class Reactors {
+public:
+	[[nodiscard]] Reactors(asio::io_context & Main, unsigned Threads) {
+		if (Threads == 0)
+			Serving_.push_back(&Main);
+		for (; Threads > 0; --Threads) {
+			auto & Ctx = Owned_.emplace_back(1);
+			Guards_.push_back(asio::make_work_guard(Ctx));
+			Serving_.push_back(&Ctx);
+		}
+	}
+	~Reactors() {
+		join();
+	}
+
+	[[nodiscard]] span<asio::io_context * const> serving() const noexcept {
+		return Serving_;
+	}
+
+	void start() {
+		for (auto & Ctx : Owned_)
+			Threads_.emplace_back([&Ctx] { Ctx.run(); });
+	}
+	// precondition: a stop is requested
+	void join() {
+		Guards_.clear();
+		Threads_.clear();
 	}
+
+private:
+	using tGuard = asio::executor_work_guard<asio::io_context::executor_type>;
+
+	deque<asio::io_context> Owned_;
+	vector<asio::io_context *> Serving_;
+	vector<tGuard> Guards_;
+	vector<jthread> Threads_;
+};
+
+// with SO_REUSEPORT, every reactor gets an acceptor of its own for each
+// endpoint and the kernel balances the incoming connections. Otherwise, the
+// first reactor accepts all connections and deals them out round-robin
+
+#ifdef SO_REUSEPORT
+using reuse_port =
+    asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+static constexpr bool SharedPorts = true;
+#else
+static constexpr bool SharedPorts = false;
+#endif
+
+// anyone with SO_REUSEPORT may share a port, another instance of this server
+// as well. Binding without it first makes sure that nobody listens there yet
+void probeEndpoint(asio::io_context & Ctx, const tEndpoint & Endpoint) {
+	tAcceptor Probe(Ctx);
+	Probe.open(Endpoint.protocol());
+	Probe.set_option(tAcceptor::reuse_address(true));
+	Probe.bind(Endpoint);
+}
+
+tAcceptor makeAcceptor(asio::io_context & Ctx, const tEndpoint & Endpoint) {
+	tAcceptor Acceptor(Ctx);
+	Acceptor.open(Endpoint.protocol());
+	Acceptor.set_option(tAcceptor::reuse_address(true));
+#ifdef SO_REUSEPORT
+	Acceptor.set_option(reuse_port(true));
+#endif
+	Acceptor.bind(Endpoint);
+	Acceptor.listen();
+	return Acceptor;
 }
 
 // the tcp acceptor is also a coroutine
-// spawns new, independent coroutines on connect
+// spawns new, independent coroutines on connect, each of them pinned to the
+// reactor it is handed to
 
-asio::awaitable<void> acceptConnections(tAcceptor Acceptor, stop_token Stop,
-                                        const fs::path Source) {
+asio::awaitable<void>
+acceptConnections(tAcceptor Acceptor, stop_token Stop,
+                  const shared_ptr<broadcast::Channel> Channel,
+                  span<asio::io_context * const> Reactors) {
 	const auto _ = killMe(Stop, Acceptor);
 
-	while (Acceptor.is_open()) {
-		auto [Error, Socket] = co_await Acceptor.async_accept();
+	for (size_t Next = 0; Acceptor.is_open(); ++Next) {
+		const auto Executor = tSocket::executor_type{
+			Reactors[Next % Reactors.size()]->get_executor()
+		};
+		auto [Error, Socket] = co_await Acceptor.async_accept(Executor);
 		if (!Stop.stop_requested() && !Error && Socket.is_open())
-			co_spawn(Acceptor.get_executor(),
-			         startStreaming(std::move(Socket), Stop, Source),
+			co_spawn(Executor, startStreaming(std::move(Socket), Stop, Channel),
 			         asio::detached);
 	}
 }
 
 // start serving a list of given endpoints
-// each endpoint is served by an independent coroutine
+// each endpoint is served by independent coroutines, all of them share the
+// one broadcast channel of the media source which does the heavy lifting on the
+// decode pool
 // precondition: !Endpoints.empty()
 
-error_code serve(asio::io_context & Ctx, stop_source Stop, tEndpoints Endpoints,
-                 const fs::path Source) {
+error_code serve(Reactors & Server, shared_ptr<broadcast::Channel> Channel,
+                 stop_source Stop, tEndpoints Endpoints) {
+	const auto Serving = Server.serving();
 	error_code Error;
 	for (const auto & Endpoint : Endpoints) {
 		try {
-			co_spawn(
-			    Ctx,
-			    acceptConnections({ Ctx, Endpoint }, Stop.get_token(), Source),
-			    asio::detached);
+			if constexpr (SharedPorts) {
+				probeEndpoint(*Serving.front(), Endpoint);
+				for (const auto & Ctx : Serving)
+					co_spawn(*Ctx,
+					         acceptConnections(makeAcceptor(*Ctx, Endpoint),
+					                           Stop.get_token(), Channel,
+					                           span{ &Ctx, 1 }),
+					         asio::detached);
+			} else {
+				auto & Ctx = *Serving.front();
+				co_spawn(Ctx,
+				         acceptConnections(makeAcceptor(Ctx, Endpoint),
+				                           Stop.get_token(), Channel, Serving),
+				         asio::detached);
+			}
 		} catch (const system_error & Ex) { Error = Ex.code(); }
 	}
 	return Error;
@@ -231,66 +475,145 @@ using Renderer =
     stdex::c_resource<SDL_Renderer, SDL_CreateRenderer, SDL_DestroyRenderer>;
 using Texture =
     stdex::c_resource<SDL_Texture, SDL_CreateTexture, SDL_DestroyTexture>;
+using Surface = stdex::c_resource<SDL_Surface,
+                                  SDL_CreateRGBSurfaceWithFormatFrom,
+                                  SDL_FreeSurface>;
 } // namespace sdl
 
 // the most minimal GUI
 // capable of showing a frame with some decor for user interaction
-// renders the video frames
+// renders the video frames through a GPU renderer if there is one. Otherwise
+// it paints them into the window surface itself, as the software renderer
+// would take several passes over the whole window for every frame
 
 struct GUI {
-	GUI(int Width, int Height) {
+	GUI(int Width, int Height, bool Software) {
 		SDL_Init(SDL_INIT_VIDEO);
-		Window_   = { "",
+		Window_ = { "",
                     SDL_WINDOWPOS_CENTERED,
                     SDL_WINDOWPOS_CENTERED,
                     Width,
                     Height,
                     SDL_WINDOW_RESIZABLE | SDL_WINDOW_HIDDEN };
-		Renderer_ = { Window_, -1, SDL_RENDERER_PRESENTVSYNC };
+		if (!Software)
+			Renderer_ = { Window_, -1,
+				          SDL_RENDERER_ACCELERATED |
+				              SDL_RENDERER_PRESENTVSYNC };
 
 		SDL_SetWindowMinimumSize(Window_, Width, Height);
-		SDL_RenderSetLogicalSize(Renderer_, Width, Height);
-		SDL_RenderSetIntegerScale(Renderer_, SDL_TRUE);
+		if (Renderer_) {
+			SDL_RenderSetLogicalSize(Renderer_, Width, Height);
+			SDL_RenderSetIntegerScale(Renderer_, SDL_TRUE);
+		}
 	}
 
+	// every frame sequence starts with a full frame, so the texture of the
+	// sequence before is good for the next one if the geometry and format
+	// stay the same, and the window is laid out anew only if the geometry
+	// changes. Filler frames keep the last picture, the window is hidden only
+	// if there is nothing to show for a while
+	// the texture takes the pixel format of the frames, so their pixels go
+	// into the texture as they are. Only indexed frames are expanded
+	// without a renderer, the frames go into a canvas in ARGB8888
 	void updateFrom(const video::FrameHeader & Header) {
-		if (!Header.Sequence_ || Header.Sequence_ < Sequence_) {
-			if (Header.empty()) {
+		if (Header.empty()) {
+			Idle_ += Header.Timestamp_;
+			if (Idle_ >= MaxIdle && Showing_) {
 				SDL_HideWindow(Window_);
-				Texture_ = sdl::Texture{};
+				Showing_ = false;
+				Hidden_  = true;
+			}
+			return;
+		}
+		Idle_ = {};
+
+		const auto Format  = sourceFormat(Header);
+		const bool Resized =
+		    Header.Width_ != Width_ || Header.Height_ != Height_;
+		if (Resized || Header.LinePitch_ != Pitch_ || Format != SourceFormat_) {
+			Width_         = Header.Width_;
+			Height_        = Header.Height_;
+			Pitch_         = Header.LinePitch_;
+			SourceFormat_  = Format;
+			TextureFormat_ = Format == SDL_PIXELFORMAT_INDEX8
+			                     ? SDL_PIXELFORMAT_ARGB8888
+			                     : Format;
+			if (Renderer_) {
+				Texture_ = texture();
 			} else {
-				Width_        = Header.Width_;
-				Height_       = Header.Height_;
-				Pitch_        = Header.LinePitch_;
-				SourceFormat_ = Header.Format_ == video::RGBA
-				                    ? SDL_PIXELFORMAT_ABGR8888
-				                    : SDL_PIXELFORMAT_ARGB8888;
-				Texture_ =
-				    sdl::Texture(Renderer_, TextureFormat,
-				                 SDL_TEXTUREACCESS_STREAMING, Width_, Height_);
-				SDL_SetWindowMinimumSize(Window_, Width_, Height_);
-				SDL_RenderSetLogicalSize(Renderer_, Width_, Height_);
-				SDL_ShowWindow(Window_);
+				Canvas_.resize(static_cast<size_t>(Width_) * Height_ * 4);
+				Dirty_.clear();
 			}
 		}
-		Sequence_ = Header.Sequence_;
+		if (Resized) {
+			SDL_SetWindowMinimumSize(Window_, Width_, Height_);
+			if (Renderer_)
+				SDL_RenderSetLogicalSize(Renderer_, Width_, Height_);
+			Relayout_ = true;
+		}
+		if (!Showing_) {
+			SDL_ShowWindow(Window_);
+			Showing_  = true;
+			Hidden_   = false; // the event may take a while
+			Relayout_ = true;
+		}
 	}
 
-	void present(video::tPixels Pixels) {
-		void * TexturePixels;
-		int TexturePitch;
+	// full frames replace the texture contents, delta frames update the changed
+	// rectangles only, and repeated frames leave the texture as it is
+	// nobody sees the texture of a hidden or minimized window, so no frame is
+	// converted and uploaded then. The texture is stale afterwards, and delta
+	// frames are of no use until the next full frame. Every frame sequence
+	// starts with one, the window shows the last picture until then
+	void update(const video::Frame & Frame) {
+		const auto Kind = Frame.Header_.kind();
+		if ((!Texture_ && Canvas_.empty()) ||
+		    (Kind != video::Full && Kind != video::Delta))
+			return;
+		if (!visible()) {
+			Stale_ = true;
+			return;
+		}
+		if (Kind == video::Delta) {
+			if (Stale_)
+				return;
+			updateRects(Frame.Pixels_);
+		} else {
+			updateAll(Frame.Pixels_);
+			Stale_ = false;
+		}
+		Changed_ = true;
+	}
 
+	// show the texture, this waits for the display refresh. Nothing to do if
+	// the window isn't visible, or if neither the texture nor the window
+	// changed since, as after filler or repeated frames
+	void render() {
+		if (!visible() || (!Changed_ && !Relayout_))
+			return;
+		Changed_ = false;
+		if (!Renderer_) {
+			present();
+			return;
+		}
 		SDL_SetRenderDrawColor(Renderer_, 240, 240, 240, 240);
 		SDL_RenderClear(Renderer_);
-		if (SDL_LockTexture(Texture_, nullptr, &TexturePixels, &TexturePitch) ==
-		    0) {
-			SDL_ConvertPixels(Width_, Height_, SourceFormat_, Pixels.data(),
-			                  Pitch_, TextureFormat, TexturePixels,
-			                  TexturePitch);
-			SDL_UnlockTexture(Texture_);
+		if (Texture_)
 			SDL_RenderCopy(Renderer_, Texture_, nullptr, nullptr);
-		}
 		SDL_RenderPresent(Renderer_);
+		Relayout_ = false;
+	}
+
+	// everything this client can deal with, limited by the texture extent.
+	// The window surface has no limits
+	[[nodiscard]] video::wire::Hello capabilities() {
+		SDL_RendererInfo Info{};
+		if (Renderer_)
+			SDL_GetRendererInfo(Renderer_, &Info);
+		return { .Version_   = video::wire::ThisProtocol,
+			     .Features_  = video::wire::AllFeatures,
+			     .MaxWidth_  = static_cast<uint32_t>(Info.max_texture_width),
+			     .MaxHeight_ = static_cast<uint32_t>(Info.max_texture_height) };
 	}
 
 	bool processEvents() {
@@ -298,21 +621,310 @@ struct GUI {
 		while (SDL_PollEvent(&event)) {
 			if (event.type == SDL_QUIT)
 				return false;
+			if (event.type == SDL_WINDOWEVENT)
+				track(event.window);
 		}
 		return true;
 	}
 
+	[[nodiscard]] bool visible() const noexcept {
+		return !Hidden_ && !Minimized_;
+	}
+
 private:
+	// the visibility and the layout of the window
+	void track(const SDL_WindowEvent & Event) {
+		switch (Event.event) {
+			case SDL_WINDOWEVENT_HIDDEN: Hidden_ = true; break;
+			case SDL_WINDOWEVENT_MINIMIZED: Minimized_ = true; break;
+			case SDL_WINDOWEVENT_SHOWN:
+				Hidden_   = false;
+				Relayout_ = true;
+				break;
+			case SDL_WINDOWEVENT_RESTORED:
+			case SDL_WINDOWEVENT_MAXIMIZED:
+				Minimized_ = false;
+				Relayout_  = true;
+				break;
+			case SDL_WINDOWEVENT_SIZE_CHANGED:
+			case SDL_WINDOWEVENT_EXPOSED: Relayout_ = true; break;
+			default: break;
+		}
+	}
+
+	// the payloads come from the network. Frames which don't hold what their
+	// headers claim, or reach beyond the frame geometry, are dropped as a whole
+
+	void updateAll(video::tPixels Pixels) {
+		if (SourceFormat_ == SDL_PIXELFORMAT_INDEX8) {
+			if (Pixels.size() < video::PaletteBytes)
+				return;
+			setPalette(Pixels.first(video::PaletteBytes));
+			Pixels = Pixels.subspan(video::PaletteBytes);
+		}
+		if (Pitch_ < Width_ * pixelSize() ||
+		    Pixels.size() < static_cast<size_t>(Pitch_) * Height_)
+			return;
+		upload({ 0, 0, Width_, Height_ }, Pixels.data(), Pitch_);
+	}
+
+	// the palette of indexed delta frames is the one of the full frame before
+	void updateRects(video::tPixels Payload) {
+		video::DeltaHeader Info;
+		if (Payload.size() < sizeof(Info))
+			return;
+		memcpy(&Info, Payload.data(), sizeof(Info));
+		const auto Rects = Payload.subspan(sizeof(Info));
+		if (Rects.size() / sizeof(video::Rect) < Info.Rects_)
+			return;
+		auto Pixels = Rects.subspan(Info.Rects_ * sizeof(video::Rect));
+
+		const auto rect = [&](uint32_t i) {
+			video::Rect Rect;
+			memcpy(&Rect, &Rects[i * sizeof(Rect)], sizeof(Rect));
+			return Rect;
+		};
+		size_t Bytes = 0;
+		for (uint32_t i = 0; i < Info.Rects_; ++i) {
+			const auto Rect = rect(i);
+			if (Rect.X_ + Rect.Width_ > Width_ ||
+			    Rect.Y_ + Rect.Height_ > Height_)
+				return;
+			Bytes += size_t{ Rect.Width_ } * Rect.Height_ * pixelSize();
+		}
+		if (Bytes > Pixels.size())
+			return;
+
+		for (uint32_t i = 0; i < Info.Rects_; ++i) {
+			const auto Rect  = rect(i);
+			const auto Pitch = Rect.Width_ * pixelSize();
+			upload({ Rect.X_, Rect.Y_, Rect.Width_, Rect.Height_ },
+			       Pixels.data(), Pitch);
+			Pixels = Pixels.subspan(static_cast<size_t>(Pitch) * Rect.Height_);
+		}
+	}
+
+	[[nodiscard]] int pixelSize() const noexcept {
+		return SourceFormat_ == SDL_PIXELFORMAT_INDEX8 ? 1 : 4;
+	}
+
+	// the pixels in the source format into the given area of the texture,
+	// copied as they are unless indexed
+	void upload(const SDL_Rect & Area, const std::byte * Pixels, int Pitch) {
+		if (!Renderer_) {
+			paint(Area, Pixels, Pitch);
+			return;
+		}
+		if (SourceFormat_ == TextureFormat_) {
+			SDL_UpdateTexture(Texture_, &Area, Pixels, Pitch);
+			return;
+		}
+
+		void * TexturePixels;
+		int TexturePitch;
+		if (SDL_LockTexture(Texture_, &Area, &TexturePixels, &TexturePitch) !=
+		    0)
+			return;
+		expandPalette(Area.w, Area.h, Pixels, Pitch, TexturePixels,
+		              TexturePitch);
+		SDL_UnlockTexture(Texture_);
+	}
+
+	// the pixels in the source format into the given area of the ARGB8888
+	// canvas. Like the texture they are copied without blending. The areas
+	// add up until the canvas is presented
+	void paint(const SDL_Rect & Area, const std::byte * Pixels, int Pitch) {
+		if (Area.x < 0 || Area.y < 0 || Area.w > Width_ - Area.x ||
+		    Area.h > Height_ - Area.y)
+			return;
+		const auto Count = static_cast<size_t>(Area.w);
+		for (int y = 0; y < Area.h; ++y, Pixels += Pitch) {
+			auto * Row = canvasAt(Area.x, Area.y + y);
+			if (SourceFormat_ == SDL_PIXELFORMAT_INDEX8)
+				pixels::expandPalette(Pixels, Row, Count, Colours_);
+			else if (SourceFormat_ == SDL_PIXELFORMAT_ABGR8888)
+				pixels::swizzle(Pixels, Row, Count);
+			else
+				memcpy(Row, Pixels, 4 * Count);
+		}
+		if ((Area.w == Width_ && Area.h == Height_) ||
+		    Dirty_.size() >= MaxDirty)
+			Dirty_.assign(1, { 0, 0, Width_, Height_ });
+		else
+			Dirty_.push_back(Area);
+	}
+
+	// the changed areas of the canvas into the window surface, scaled up by
+	// the largest integer factor which fits and centered in the window like
+	// the renderer does it. Only these areas are updated on screen, unless the
+	// window needs to be laid out anew
+	void present() {
+		auto * Surface = SDL_GetWindowSurface(Window_);
+		if (!Surface)
+			return;
+		if (Relayout_)
+			SDL_FillRect(Surface, nullptr,
+			             SDL_MapRGB(Surface->format, 240, 240, 240));
+
+		Updated_.clear();
+		const auto Scale = Canvas_.empty()
+		                       ? 0
+		                       : min(Surface->w / Width_, Surface->h / Height_);
+		if (Scale > 0) {
+			if (Relayout_)
+				Dirty_.assign(1, { 0, 0, Width_, Height_ });
+			const auto X = (Surface->w - Width_ * Scale) / 2;
+			const auto Y = (Surface->h - Height_ * Scale) / 2;
+			for (const auto & Area : Dirty_)
+				Updated_.push_back({ X + Area.x * Scale, Y + Area.y * Scale,
+				                     Area.w * Scale, Area.h * Scale });
+			const auto Format = Surface->format->format;
+			if (Format == SDL_PIXELFORMAT_ARGB8888 ||
+			    Format == SDL_PIXELFORMAT_RGB888)
+				scaleInto(Surface, Scale);
+			else
+				blitInto(Surface);
+			Dirty_.clear();
+		}
+
+		if (Relayout_)
+			SDL_UpdateWindowSurface(Window_);
+		else if (!Updated_.empty())
+			SDL_UpdateWindowSurfaceRects(Window_, Updated_.data(),
+			                             static_cast<int>(Updated_.size()));
+		Relayout_ = false;
+	}
+
+	// the surface has the layout of the canvas, the pixels are just repeated
+	// Scale times in both directions
+	void scaleInto(SDL_Surface * Surface, int Scale) {
+		if (SDL_LockSurface(Surface) != 0)
+			return;
+		auto * const Pixels = static_cast<std::byte *>(Surface->pixels);
+		const auto Pitch    = static_cast<size_t>(Surface->pitch);
+		for (size_t i = 0; i < Dirty_.size(); ++i) {
+			const auto & Area   = Dirty_[i];
+			const auto & Target = Updated_[i];
+			const auto Bytes    = static_cast<size_t>(Target.w) * 4;
+			for (int y = 0; y < Area.h; ++y) {
+				auto * Out = Pixels +
+				             static_cast<size_t>(Target.y + y * Scale) * Pitch +
+				             static_cast<size_t>(Target.x) * 4;
+				pixels::widen(canvasAt(Area.x, Area.y + y), Out,
+				              static_cast<size_t>(Area.w),
+				              static_cast<unsigned>(Scale));
+				pixels::copyRows(Out, 0, Out + Pitch, Pitch, Bytes,
+				                 static_cast<size_t>(Scale - 1));
+			}
+		}
+		SDL_UnlockSurface(Surface);
+	}
+
+	// any other surface format is left to SDL
+	void blitInto(SDL_Surface * Surface) {
+		sdl::Surface Source(Canvas_.data(), Width_, Height_, 32, Width_ * 4,
+		                    SDL_PIXELFORMAT_ARGB8888);
+		if (!Source)
+			return;
+		SDL_SetSurfaceBlendMode(Source, SDL_BLENDMODE_NONE);
+		for (size_t i = 0; i < Dirty_.size(); ++i) {
+			auto Target = Updated_[i];
+			SDL_UpperBlitScaled(Source, &Dirty_[i], Surface, &Target);
+		}
+	}
+
+	// the texture for the current geometry and format, taken from the cache
+	// of the most recently used ones if possible
+	[[nodiscard]] SDL_Texture * texture() {
+		const auto Hit =
+		    ranges::find_if(Textures_, [this](const CachedTexture & Cached) {
+			    return Cached.Width_ == Width_ && Cached.Height_ == Height_ &&
+			           Cached.Format_ == TextureFormat_;
+		    });
+		if (Hit != Textures_.end()) {
+			rotate(Textures_.begin(), Hit, next(Hit));
+		} else {
+			sdl::Texture Texture(Renderer_, TextureFormat_,
+			                     SDL_TEXTUREACCESS_STREAMING, Width_, Height_);
+			if (!Texture)
+				return nullptr;
+			if (Textures_.size() == MaxTextures)
+				Textures_.pop_back();
+			Textures_.insert(Textures_.begin(),
+			                 { Width_, Height_, TextureFormat_,
+			                   std::move(Texture) });
+		}
+		return Textures_.front().Texture_;
+	}
+
+	[[nodiscard]] std::byte * canvasAt(int X, int Y) noexcept {
+		return Canvas_.data() +
+		       (static_cast<size_t>(Y) * Width_ + static_cast<size_t>(X)) * 4;
+	}
+
+	[[nodiscard]] static uint32_t
+	sourceFormat(const video::FrameHeader & Header) noexcept {
+		switch (Header.format()) {
+			case video::PAL8: return SDL_PIXELFORMAT_INDEX8;
+			case video::RGBA: return SDL_PIXELFORMAT_ABGR8888;
+			case video::BGRA: return SDL_PIXELFORMAT_ARGB8888;
+			default: return SDL_PIXELFORMAT_UNKNOWN;
+		}
+	}
+
+	// the palette converted to the (ARGB8888) texture format
+	void setPalette(video::tPixels Palette) {
+		for (unsigned i = 0; i < video::PaletteEntries; ++i) {
+			const auto * Entry = &Palette[4 * i];
+			Colours_[i] = to_integer<uint32_t>(Entry[0]) |
+			              to_integer<uint32_t>(Entry[1]) << 8 |
+			              to_integer<uint32_t>(Entry[2]) << 16 |
+			              to_integer<uint32_t>(Entry[3]) << 24;
+		}
+	}
+
+	// look up the indices of a PAL8 frame in the palette
+	void expandPalette(int Width, int Height, const std::byte * Indices,
+	                   int Pitch, void * Texture, int TexturePitch) const {
+		for (int y = 0; y < Height; ++y)
+			pixels::expandPalette(
+			    Indices + static_cast<size_t>(y) * Pitch,
+			    static_cast<std::byte *>(Texture) +
+			        static_cast<size_t>(y) * TexturePitch,
+			    static_cast<size_t>(Width), Colours_);
+	}
+
+	static constexpr size_t MaxDirty    = 64;
+	static constexpr size_t MaxTextures = 4;
+	static constexpr auto MaxIdle       = 1s;
+
+	struct CachedTexture {
+		int Width_;
+		int Height_;
+		uint32_t Format_;
+		sdl::Texture Texture_;
+	};
+
 	sdl::Window Window_;
-	sdl::Renderer Renderer_;
-	sdl::Texture Texture_;
-	int Sequence_ = INT_MAX;
-	int Width_;
-	int Height_;
-	int Pitch_;
-	int SourceFormat_;
-
-	static constexpr auto TextureFormat = SDL_PIXELFORMAT_ARGB8888;
+	sdl::Renderer Renderer_; // none if painting into the window surface
+	vector<CachedTexture> Textures_;
+	SDL_Texture * Texture_ = nullptr; // the first of the cached ones
+	int Width_  = 0;
+	int Height_ = 0;
+	int Pitch_  = 0;
+	uint32_t SourceFormat_  = SDL_PIXELFORMAT_UNKNOWN;
+	uint32_t TextureFormat_ = SDL_PIXELFORMAT_ARGB8888;
+	array<uint32_t, video::PaletteEntries> Colours_{};
+	vector<std::byte> Canvas_;
+	vector<SDL_Rect> Dirty_;   // the areas of the canvas changed since shown
+	vector<SDL_Rect> Updated_; // the same areas in the window surface
+	bool Relayout_  = true;
+	bool Changed_   = false;
+	bool Stale_     = false; // frames were skipped while not visible
+	bool Showing_   = false; // as far as this GUI is concerned
+	bool Hidden_    = true;  // as far as the window system is concerned
+	bool Minimized_ = false;
+	microseconds Idle_{}; // filler frames in a row
 };
 
 } // namespace
@@ -333,35 +945,276 @@ private:
 	size_t Size_ = 0;
 };
 
+// headers from the wire are taken only if their geometry makes sense and
+// stays within what this client asked for, before anything is allocated for
+// the payload. Frames without pixels, like fillers, have no geometry at all
+
+static constexpr int32_t MaxExtent = 16384; // if the client sets no limit
+
+[[nodiscard]] bool plausible(const video::FrameHeader & Header,
+                             const video::wire::Hello & Limits) noexcept {
+	if (Header.Width_ == 0 && Header.Height_ == 0 && Header.LinePitch_ == 0)
+		return true;
+	if (Header.Format_ != video::RGBA && Header.Format_ != video::BGRA &&
+	    Header.Format_ != video::PAL8)
+		return false;
+	const auto Element = Header.Format_ == video::PAL8 ? 1 : 4;
+	return Header.Width_ > 0 && Header.Height_ > 0 &&
+	       Header.Width_ <= MaxExtent && Header.Height_ <= MaxExtent &&
+	       Header.LinePitch_ / Element >= Header.Width_ &&
+	       Header.LinePitch_ / Element <= MaxExtent && Limits.fits(Header);
+}
+
 asio::awaitable<video::Frame> receiveFrame(tSocket & Socket, tTimer & Timer,
-                                           GrowingSpace & PixelSpace) {
-	alignas(video::FrameHeader) std::byte Header[video::FrameHeader::Size];
-	tExpected<size_t> Result = co_await receiveFrom(Socket, Timer, Header);
-	if (Result == video::FrameHeader::Size) {
-		const auto & FrameHeader = *new (Header) video::FrameHeader;
-		auto Pixels              = PixelSpace.get(FrameHeader.size());
-		if (!Pixels.empty())
-			Result = co_await receiveFrom(Socket, Timer, Pixels);
-		if (FrameHeader.filler() || Result == Pixels.size())
-			co_return video::Frame{ FrameHeader, Pixels };
+                                           GrowingSpace & PixelSpace,
+                                           const video::wire::Hello & Limits) {
+	using namespace video::wire;
+
+	// every header starts with the V1Size bytes which tell the version
+	array<std::byte, V2Size> Wire;
+	const auto Prefix = span{ Wire }.first<V1Size>();
+	if (!(co_await receiveFrom(Socket, Timer, Prefix) == V1Size))
+		co_return video::noFrame;
+
+	video::FrameHeader FrameHeader;
+	const auto Version = version(Prefix);
+	if (Version == 1) {
+		FrameHeader = decodeV1(Prefix);
+	} else if (Version == 2) {
+		const auto Rest = span{ Wire }.last<V2Size - V1Size>();
+		if (!(co_await receiveFrom(Socket, Timer, Rest) == Rest.size()))
+			co_return video::noFrame;
+		FrameHeader = decodeV2(Wire);
+		if (FrameHeader.size() > FrameHeader.maxSize())
+			co_return video::noFrame; // no payload is larger than that
+	} else {
+		co_return video::noFrame;
+	}
+	if (!plausible(FrameHeader, Limits))
+		co_return video::noFrame;
+
+	// the size of version 1 delta frames is known from their DeltaHeader only
+	video::DeltaHeader Delta{};
+	const auto Legacy = Version == 1 && FrameHeader.kind() == video::Delta;
+	if (Legacy) {
+		const auto Info = as_writable_bytes(span{ &Delta, 1 });
+		if (!(co_await receiveFrom(Socket, Timer, Info) == sizeof(Delta)))
+			co_return video::noFrame;
+		FrameHeader.PayloadSize_ += Delta.Bytes_;
+		if (FrameHeader.size() > FrameHeader.maxSize())
+			co_return video::noFrame; // no delta is larger than that
+	}
+	auto Pixels = PixelSpace.get(FrameHeader.size());
+	auto Space  = Pixels;
+	if (Legacy) {
+		memcpy(Pixels.data(), &Delta, sizeof(Delta));
+		Space = Pixels.subspan(sizeof(Delta));
 	}
+	if (Space.empty() ||
+	    co_await receiveFrom(Socket, Timer, Space) == Space.size())
+		co_return video::Frame{ FrameHeader, Pixels };
 	co_return video::noFrame;
 }
 
-asio::awaitable<void> rollVideos(stop_token Stop, tSocket & Socket,
-                                 tTimer & Timer, GUI & UI) {
-	GrowingSpace PixelSpace;
+// the client takes its frames from any of three sources with the same
+// interface: next() returns the next frame, valid until the following call,
+// and behind() tells if there is another frame waiting already
+
+// frames received from a network connection. Packed frames are unpacked and
+// compressed packets are decoded right here. The payloads are received into
+// the given space, the others live here
+class NetworkFrames {
+public:
+	[[nodiscard]] NetworkFrames(tSocket & Socket, tTimer & Timer,
+	                            video::wire::Hello Limits)
+	: Socket_{ Socket }
+	, Timer_{ Timer }
+	, Limits_{ Limits } {}
+
+	asio::awaitable<video::Frame> next(GrowingSpace & PixelSpace) {
+		Timer_.expires_after(2s); // time budget for the *whole* operation,
+		// not just for single tcp socket reads!
+		auto Frame =
+		    co_await receiveFrame(Socket_, Timer_, PixelSpace, Limits_);
+		if (Frame.Header_.Flags_ & video::Packed)
+			Frame = unpacked(Frame);
+		if (Frame.Header_.kind() == video::Packet)
+			co_return Decoder_.decode(Frame);
+		co_return Frame;
+	}
+
+private:
+	// the frame with its payload unpacked, no frame if the payload is broken
+	video::Frame unpacked(const video::Frame & Frame) {
+		const auto Size = packing::unpackedSize(Frame.Pixels_);
+		auto Header     = Frame.Header_;
+		Header.Flags_ = static_cast<uint16_t>(Header.Flags_ & ~video::Packed);
+		Header.PayloadSize_ = Size;
+		if (Size == 0 || Size > Header.maxSize())
+			return video::noFrame;
+		const auto Pixels = UnpackSpace_.get(Size);
+		if (!packing::unpack(Frame.Pixels_, Pixels))
+			return video::noFrame;
+		return { Header, Pixels };
+	}
+
+	tSocket & Socket_;
+	tTimer & Timer_;
+	video::wire::Hello Limits_; // as told to the server
+	GrowingSpace UnpackSpace_;
+	videodecoder::PacketDecoder Decoder_;
+};
+
+// frames handed over from the network thread to the GUI thread in a few
+// frame buffers (triple buffering). The GUI thread takes the frames in order,
+// as deltas need the frames before them, but it shows only the newest of the
+// frames waiting. So the network thread hardly ever waits for the display
+// refresh, it blocks only while all buffers are taken
+// payloads are received right into the buffers, and go from there into the
+// texture
+
+class FrameMailbox : public enable_shared_from_this<FrameMailbox> {
+public:
+	[[nodiscard]] explicit FrameMailbox(asio::any_io_executor Executor)
+	: Ready_{ std::move(Executor), steady_clock::time_point::max() } {
+		for (auto & Slot : Slots_)
+			Free_.push_back(&Slot);
+	}
+
+	// the network side
+	// a free buffer to receive the next frame into, nullptr if closed
+	GrowingSpace * claim() {
+		unique_lock Lock(Mutex_);
+		Room_.wait(Lock, [this] { return Closed_ || !Free_.empty(); });
+		if (Closed_)
+			return nullptr;
+		Claimed_ = Free_.back();
+		Free_.pop_back();
+		return &Claimed_->Space_;
+	}
+	// hand over the frame in the claimed buffer. Frames which live elsewhere
+	// are copied into it
+	void post(const video::Frame & Frame) {
+		auto * Slot       = exchange(Claimed_, nullptr);
+		const auto Pixels = Slot->Space_.get(Frame.Pixels_.size());
+		if (!Pixels.empty() && Pixels.data() != Frame.Pixels_.data())
+			memcpy(Pixels.data(), Frame.Pixels_.data(), Pixels.size());
+		Slot->Frame_ = { Frame.Header_, Pixels };
+		{
+			const lock_guard Lock(Mutex_);
+			Filled_.push_back(Slot);
+		}
+		wakeup();
+	}
+	void close() {
+		{
+			const lock_guard Lock(Mutex_);
+			Closed_ = true;
+		}
+		Room_.notify_all();
+		wakeup();
+	}
+
+	// the GUI side
+	// precondition: runs on the executor of the mailbox
+	asio::awaitable<video::Frame> next() {
+		for (;;) {
+			{
+				const lock_guard Lock(Mutex_);
+				if (Shown_) {
+					Free_.push_back(exchange(Shown_, nullptr));
+					Room_.notify_one();
+				}
+				if (!Filled_.empty()) {
+					Shown_ = Filled_.front();
+					Filled_.pop_front();
+					co_return Shown_->Frame_;
+				}
+				if (Closed_)
+					co_return video::noFrame;
+			}
+			co_await Ready_.async_wait(); // woken up by cancellation only
+		}
+	}
+	[[nodiscard]] bool behind() {
+		const lock_guard Lock(Mutex_);
+		return !Filled_.empty();
+	}
+
+	[[nodiscard]] asio::any_io_executor get_executor() {
+		return Ready_.get_executor();
+	}
+
+private:
+	static constexpr size_t Depth = 3;
+
+	struct Slot {
+		video::Frame Frame_;
+		GrowingSpace Space_;
+	};
+
+	void wakeup() {
+		asio::post(Ready_.get_executor(),
+		           [Self = shared_from_this()] { Self->Ready_.cancel(); });
+	}
+
+	tTimer Ready_;
+	mutex Mutex_;
+	condition_variable Room_;
+	array<Slot, Depth> Slots_;
+	vector<Slot *> Free_;
+	deque<Slot *> Filled_;
+	Slot * Claimed_ = nullptr; // touched by the network side only
+	Slot * Shown_   = nullptr;
+	bool Closed_    = false;
+};
+
+// frames taken straight from the broadcast channel of the server in the same
+// process. The frames are shared with the channel rather than copied, and
+// they are decoded and unpacked already
+class ChannelFrames {
+public:
+	[[nodiscard]] ChannelFrames(broadcast::Subscription & Subscription,
+	                            video::wire::Hello Capabilities)
+	: Subscription_{ Subscription }
+	, Capabilities_{ Capabilities } {
+		Capabilities_.Features_ &= static_cast<uint16_t>(
+		    ~(video::wire::Packets | video::wire::Compression));
+	}
+
+	asio::awaitable<video::Frame> next() {
+		while (const auto Frame = co_await Subscription_.next()) {
+			if (auto Payload = Frame->select(Capabilities_, Shown_)) {
+				Current_ = std::move(*Payload);
+				co_return video::Frame{ Current_.Header_, Current_.bytes() };
+			}
+		}
+		co_return video::noFrame;
+	}
+	// the channel skips the frames a subscriber is too slow for
+	[[nodiscard]] bool behind() const noexcept {
+		return false;
+	}
+
+private:
+	broadcast::Subscription & Subscription_;
+	video::wire::Hello Capabilities_;
+	broadcast::Payload Current_;
+	broadcast::PeerState Shown_;
+};
 
+template <typename Source>
+asio::awaitable<void> rollVideos(stop_token Stop, Source & Frames, GUI & UI) {
 	while (!Stop.stop_requested()) {
-		Timer.expires_after(2s); // time budget for the *whole* operation,
-		// not just for single tcp socket reads!
-		const auto Frame    = co_await receiveFrame(Socket, Timer, PixelSpace);
+		const auto Frame    = co_await Frames.next();
 		const auto & Header = Frame.Header_;
 		if (Header.null())
 			co_return;
 
 		UI.updateFrom(Header);
-		UI.present(Frame.Pixels_);
+		UI.update(Frame);
+		if (!Frames.behind()) // only the newest of the waiting frames is shown
+			UI.render();
 
 		if (Header.filler())
 			println("filler");
@@ -371,24 +1224,162 @@ asio::awaitable<void> rollVideos(stop_token Stop, tSocket & Socket,
 	}
 }
 
-// the video receive-render-present loop, implemented as coroutine on the heap
-// brought down by internal events or through a stop-token
+// the video receive loop on the network thread, implemented as coroutine on
+// the heap. It ends with the connection, and closes the mailbox then
 
-asio::awaitable<void> showVideos(asio::io_context & Ctx, stop_source Stop,
-                                 GUI & UI, tEndpoints Endpoints) {
-	tTimer Timer(Ctx);
+asio::awaitable<void> receiveVideos(stop_source Stop, tEndpoints Endpoints,
+                                    video::wire::Hello Capabilities,
+                                    shared_ptr<FrameMailbox> Mailbox) {
+	tTimer Timer(co_await asio::this_coro::executor);
 	Timer.expires_after(2s);
+	// a quit while still connecting must not wait out the timeout
+	const auto Connecting = killMe(Stop, Timer);
 	if (tExpected<tSocket> Connection = co_await connectTo(Endpoints, Timer);
-	    Connection) {
+	    Connection && !Stop.stop_requested()) {
 		auto & Socket = Connection.value();
 		const auto _  = killMe(Stop, Socket, Timer);
 
-		co_await rollVideos(Stop.get_token(), Socket, Timer, UI);
+		const auto Hello = video::wire::encode(Capabilities);
+		auto Buffers     = SendBuffers<1>{ buffer(ConstByteSpan{ Hello }) };
+		if (co_await sendTo(Socket, Timer, Buffers)) {
+			NetworkFrames Frames(Socket, Timer, Capabilities);
+			while (!Stop.stop_requested()) {
+				auto * Space = Mailbox->claim();
+				if (!Space)
+					break;
+				const auto Frame = co_await Frames.next(*Space);
+				if (Frame.Header_.null())
+					break;
+				Mailbox->post(Frame);
+			}
+		}
 	}
+	Mailbox->close();
+}
+
+// the video render-present loop, implemented as coroutine on the heap
+// brought down by internal events or through a stop-token
+// the frames are received on a network thread of its own, waiting for the
+// display refresh never stalls the connection
+
+asio::awaitable<void> showVideos(asio::io_context & Ctx, stop_source Stop,
+                                 GUI & UI, tEndpoints Endpoints) {
+	asio::io_context Network(1);
+	const auto Mailbox = make_shared<FrameMailbox>(Ctx.get_executor());
+	co_spawn(Network,
+	         receiveVideos(Stop, Endpoints, UI.capabilities(), Mailbox),
+	         asio::detached);
+	const jthread Receiver([&Network] { Network.run(); });
+	{
+		const auto _ = killMe(Stop, *Mailbox);
+		co_await rollVideos(Stop.get_token(), *Mailbox, UI);
+	}
+	Stop.request_stop();
+	Mailbox->close();
+}
+
+// the same loop fed by the server in this very process, no network involved
+
+asio::awaitable<void> showVideos(asio::io_context & Ctx, stop_source Stop,
+                                 GUI & UI, broadcast::Channel & Server) {
+	const auto Subscription = Server.subscribe(Ctx.get_executor());
+	const auto _            = killMe(Stop, *Subscription);
+
+	ChannelFrames Frames(*Subscription, UI.capabilities());
+	co_await rollVideos(Stop.get_token(), Frames, UI);
 	Stop.request_stop();
 }
 } // namespace
 
+// benchmark
+namespace {
+// time the pixel kernels on 1080p frames at every level the CPU supports,
+// compared to SDL doing the same jobs
+
+template <typename F>
+double millisecondsPer(F && Job) {
+	constexpr int Rounds = 50;
+	const auto Start     = steady_clock::now();
+	for (int i = 0; i < Rounds; ++i)
+		Job();
+	return duration<double, milli>(steady_clock::now() - Start).count() /
+	       Rounds;
+}
+
+int benchmarkPixels() {
+	constexpr int Width         = 1920;
+	constexpr int Height        = 1080;
+	constexpr int Pitch         = Width * 4;
+	constexpr size_t Pixels     = size_t{ Width } * Height;
+	constexpr uint32_t Backdrop = 0xFFF0F0F0;
+
+	vector<std::byte> Source(Pixels * 4), Target(Pixels * 4), Indices(Pixels);
+	array<uint32_t, video::PaletteEntries> Palette;
+	array<SDL_Color, video::PaletteEntries> Colours;
+	minstd_rand Random;
+	const auto noise = [&] { return static_cast<std::byte>(Random()); };
+	ranges::generate(Source, noise);
+	ranges::generate(Indices, noise);
+	for (size_t i = 0; i < Palette.size(); ++i) {
+		Palette[i] = static_cast<uint32_t>(Random()) | 0xFF000000;
+		Colours[i] = { static_cast<Uint8>(Palette[i] >> 16),
+			           static_cast<Uint8>(Palette[i] >> 8),
+			           static_cast<Uint8>(Palette[i]), 255 };
+	}
+
+	sdl::Surface Indexed(Indices.data(), Width, Height, 8, Width,
+	                     SDL_PIXELFORMAT_INDEX8);
+	sdl::Surface Overlay(Source.data(), Width, Height, 32, Pitch,
+	                     SDL_PIXELFORMAT_ARGB8888);
+	sdl::Surface Canvas(Target.data(), Width, Height, 32, Pitch,
+	                    SDL_PIXELFORMAT_ARGB8888);
+	if (!Indexed || !Overlay || !Canvas)
+		return -6;
+	SDL_SetPaletteColors(Indexed->format->palette, Colours.data(), 0,
+	                     static_cast<int>(Colours.size()));
+	SDL_SetSurfaceBlendMode(Overlay, SDL_BLENDMODE_BLEND);
+
+	println("{:<8} {:>10} {:>10} {:>10}  [ms per frame]", "", "swizzle",
+	        "palette", "blend");
+	println("{:<8} {:>10.3f} {:>10.3f} {:>10.3f}", "SDL",
+	        millisecondsPer([&] {
+		        SDL_ConvertPixels(Width, Height, SDL_PIXELFORMAT_ABGR8888,
+		                          Source.data(), Pitch,
+		                          SDL_PIXELFORMAT_ARGB8888, Target.data(),
+		                          Pitch);
+	        }),
+	        millisecondsPer([&] {
+		        SDL_UpperBlit(Indexed, nullptr, Canvas, nullptr);
+	        }),
+	        millisecondsPer([&] {
+		        SDL_FillRect(Canvas, nullptr, Backdrop);
+		        SDL_UpperBlit(Overlay, nullptr, Canvas, nullptr);
+	        }));
+
+	using enum pixels::Level;
+	const auto Chosen = pixels::level();
+	for (const auto Level : { Scalar, SSE2, AVX2, AVX512 }) {
+		if (!pixels::use(Level))
+			continue;
+		println(
+		    "{:<8} {:>10.3f} {:>10.3f} {:>10.3f}", pixels::name(Level),
+		    millisecondsPer([&] {
+			    pixels::swizzle(Source.data(), Target.data(), Pixels);
+		    }),
+		    millisecondsPer([&] {
+			    pixels::expandPalette(Indices.data(), Target.data(), Pixels,
+			                          Palette);
+		    }),
+		    millisecondsPer([&] {
+			    pixels::blendOver(Source.data(), Target.data(), Pixels,
+			                      Backdrop);
+		    }));
+	}
+	pixels::use(Chosen);
+	return 0;
+}
+} // namespace
+
 // user interaction
 namespace {
 // stop not only through a window button press but also from the command line
@@ -423,27 +1414,52 @@ asio::awaitable<void> handleGUIEvents(asio::io_context & Ctx, stop_source Stop,
 
 int main(int argc, char const * argv[]) {
 	caboodle::passCommandLine(argc, argv);
-	const auto [MediaDirectory, ServerName] = caboodle::getOptions();
+	const auto [MediaDirectory, ServerName, ServerThreads, CacheSize,
+	            OverNetwork, CatalogFile, PackInto, MaxLateness, Benchmark,
+	            Software] =
+	    caboodle::getOptions();
 	if (MediaDirectory.empty())
 		return -2;
+	if (!PackInto.empty())
+		return broadcast::pack(MediaDirectory, PackInto) ? 0 : -5;
+	if (Benchmark)
+		return benchmarkPixels();
 	const auto ServerEndpoints =
 	    resolveHostEndpoints(ServerName, ServerPort, 1s);
 	if (ServerEndpoints.empty())
 		return -3;
+	videodecoder::limitFrameCache(size_t{ CacheSize } << 20);
+	videodecoder::openCatalog(CatalogFile, MediaDirectory,
+	                          thread::hardware_concurrency());
 
 	asio::io_context Ctx;
 	stop_source Stop; // the mother of all stops
-
-	const auto Error =
-	    serve(Ctx, Stop, ServerEndpoints, std::move(MediaDirectory));
+	// keep all blocking decoder calls away from the io_contexts
+	asio::thread_pool DecodePool(max(thread::hardware_concurrency(), 2u));
+	Reactors Server(Ctx, ServerThreads);
+	const auto Channel = make_shared<broadcast::Channel>(
+	    Server.serving().front()->get_executor(), DecodePool.get_executor(),
+	    std::move(MediaDirectory), milliseconds{ MaxLateness });
+
+	const auto Error = serve(Server, Channel, Stop, ServerEndpoints);
 	if (Error)
 		return -4;
+	Server.start();
 
-	GUI UI(1280, 1024);
+	GUI UI(1280, 1024, Software);
 
 	co_spawn(Ctx, stopOnSignal(Ctx, Stop), asio::detached);
 	co_spawn(Ctx, handleGUIEvents(Ctx, Stop, UI), asio::detached);
-	co_spawn(Ctx, showVideos(Ctx, Stop, UI, ServerEndpoints), asio::detached);
+	// the client connects to the very server of this process, therefore it
+	// takes the frames directly from the source instead of over loopback
+	if (OverNetwork)
+		co_spawn(Ctx, showVideos(Ctx, Stop, UI, ServerEndpoints),
+		         asio::detached);
+	else
+		co_spawn(Ctx, showVideos(Ctx, Stop, UI, *Channel), asio::detached);
 
 	Ctx.run();
+	Server.join();
+	logLateness(Channel->lateness());
+	videodecoder::closeCatalog();
 }
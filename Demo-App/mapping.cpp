@@ -0,0 +1,175 @@
+module;
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#ifndef _WIN32
+#	include <fcntl.h>
+#	include <sys/mman.h>
+#	include <sys/stat.h>
+#	include <unistd.h>
+#endif
+
+module media.mapping;
+
+using namespace std; // bad practice - only for presentation!
+
+namespace fs = std::filesystem;
+
+#ifdef _WIN32
+#	define APICALL __declspec(dllimport) __stdcall
+
+namespace winapi {
+extern "C" {
+void * APICALL CreateFileW(const wchar_t *, unsigned long, unsigned long,
+                           void *, unsigned long, unsigned long, void *);
+int APICALL GetFileSizeEx(void *, long long *);
+void * APICALL CreateFileMappingW(void *, void *, unsigned long, unsigned long,
+                                  unsigned long, const wchar_t *);
+void * APICALL MapViewOfFile(void *, unsigned long, unsigned long,
+                             unsigned long, size_t);
+int APICALL UnmapViewOfFile(const void *);
+int APICALL CloseHandle(void *);
+void * APICALL GetCurrentProcess();
+int APICALL PrefetchVirtualMemory(void *, size_t, void *, unsigned long);
+}
+
+struct MemoryRange {
+	void * Address_;
+	size_t Size_;
+};
+
+static constexpr unsigned long GenericRead    = 0x80000000;
+static constexpr unsigned long ShareAll       = 0x00000007;
+static constexpr unsigned long OpenExisting   = 3;
+static constexpr unsigned long SequentialScan = 0x08000000;
+static constexpr unsigned long PageReadonly   = 0x02;
+static constexpr unsigned long FileMapRead    = 0x04;
+static const auto InvalidHandle = reinterpret_cast<void *>(intptr_t{ -1 });
+} // namespace winapi
+#endif
+
+namespace mapping {
+
+// map the whole file, nullptr if that fails. The file stays open on POSIX
+
+static void * mapFile(const fs::path & Path, size_t & Size, int & Handle) {
+#ifdef _WIN32
+	using namespace winapi;
+	const auto File = CreateFileW(Path.c_str(), GenericRead, ShareAll, nullptr,
+	                              OpenExisting, SequentialScan, nullptr);
+	if (File == InvalidHandle)
+		return nullptr;
+	long long FileSize = 0;
+	void * Mapping     = nullptr;
+	if (GetFileSizeEx(File, &FileSize) && FileSize > 0)
+		Mapping =
+		    CreateFileMappingW(File, nullptr, PageReadonly, 0, 0, nullptr);
+	CloseHandle(File);
+	if (Mapping == nullptr)
+		return nullptr;
+	const auto Address = MapViewOfFile(Mapping, FileMapRead, 0, 0, 0);
+	CloseHandle(Mapping); // the view keeps the mapping alive
+	// Windows refuses to truncate mapped files, there is nothing to check
+	Size   = static_cast<size_t>(FileSize);
+	Handle = -1;
+	return Address;
+#else
+	const auto File = ::open(Path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (File < 0)
+		return nullptr;
+	struct stat Info;
+	void * Address = MAP_FAILED;
+	if (fstat(File, &Info) == 0 && S_ISREG(Info.st_mode) && Info.st_size > 0)
+		Address = mmap(nullptr, static_cast<size_t>(Info.st_size), PROT_READ,
+		               MAP_SHARED, File, 0);
+	if (Address == MAP_FAILED) {
+		::close(File);
+		return nullptr;
+	}
+	Size   = static_cast<size_t>(Info.st_size);
+	Handle = File;
+	return Address;
+#endif
+}
+
+MappedFile::MappedFile(Private, void * Address, size_t Size, int File,
+                       catalog::FileStamp Stamp) noexcept
+: Address_{ Address }
+, Size_{ Size }
+, File_{ File }
+, Stamp_{ Stamp } {}
+
+MappedFile::~MappedFile() {
+#ifdef _WIN32
+	winapi::UnmapViewOfFile(Address_);
+#else
+	munmap(Address_, Size_);
+	::close(File_);
+#endif
+}
+
+size_t MappedFile::intact() const noexcept {
+#ifdef _WIN32
+	return Size_;
+#else
+	// touching the pages beyond the end of a truncated file raises SIGBUS
+	struct stat Info;
+	if (fstat(File_, &Info) != 0)
+		return 0;
+	return min(Size_, static_cast<size_t>(max<off_t>(Info.st_size, 0)));
+#endif
+}
+
+void MappedFile::willNeed(size_t Offset, size_t Size) const noexcept {
+	if (Offset >= Size_)
+		return;
+	Size = min(Size, Size_ - Offset);
+#ifdef _WIN32
+	winapi::MemoryRange Range{ static_cast<std::byte *>(Address_) + Offset,
+		                       Size };
+	winapi::PrefetchVirtualMemory(winapi::GetCurrentProcess(), 1, &Range, 0);
+#else
+	// madvise wants page boundaries
+	static const auto PageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+	const auto Start           = Offset / PageSize * PageSize;
+	madvise(static_cast<std::byte *>(Address_) + Start, Size + Offset - Start,
+	        MADV_WILLNEED);
+#endif
+}
+
+// the mappings currently in use, by path. A mapping is reused as long as the
+// file stays the same
+
+static mutex Mutex;
+static unordered_map<fs::path::string_type, weak_ptr<const MappedFile>>
+    Mappings;
+
+shared_ptr<const MappedFile> MappedFile::open(const fs::path & Path) {
+	const auto Stamp = catalog::getStamp(Path);
+	const lock_guard Lock(Mutex);
+	auto & Slot = Mappings[Path.native()];
+	if (auto Shared = Slot.lock(); Shared && Shared->stamp() == Stamp)
+		return Shared;
+
+	size_t Size        = 0;
+	int File           = -1;
+	const auto Address = mapFile(Path, Size, File);
+	if (Address == nullptr) {
+		Mappings.erase(Path.native());
+		return {};
+	}
+	auto Shared =
+	    make_shared<const MappedFile>(Private{}, Address, Size, File, Stamp);
+	Slot = Shared;
+
+	// forget about the mappings which are gone
+	erase_if(Mappings,
+	         [](const auto & Entry) { return Entry.second.expired(); });
+	return Shared;
+}
+} // namespace mapping
@@ -0,0 +1,54 @@
+module;
+#include <cstddef>
+#include <filesystem>
+#include <memory>
+#include <span>
+
+export module media.mapping;
+import media.catalog;
+
+using namespace std; // bad practice - only for presentation!
+
+// read-only memory mappings of whole files
+// all readers of a file share one mapping, the page cache serves them all
+// without any further syscalls or copies. Files that shrink while mapped fault
+// on access beyond their new end. Checking intact() now and then helps, but
+// can't rule that out
+
+namespace mapping {
+
+export class MappedFile {
+	struct Private {};
+
+public:
+	// the mapping of the file at Path, shared with all other current readers
+	// of the same file contents. Nothing if the file can't be mapped
+	[[nodiscard]] static shared_ptr<const MappedFile>
+	open(const filesystem::path & Path);
+
+	[[nodiscard]] MappedFile(Private, void * Address, size_t Size, int File,
+	                         catalog::FileStamp Stamp) noexcept;
+	~MappedFile();
+	MappedFile(const MappedFile &)             = delete;
+	MappedFile & operator=(const MappedFile &) = delete;
+
+	[[nodiscard]] span<const std::byte> bytes() const noexcept {
+		return { static_cast<const std::byte *>(Address_), Size_ };
+	}
+	[[nodiscard]] const catalog::FileStamp & stamp() const noexcept {
+		return Stamp_;
+	}
+	// the number of leading bytes which are still backed by the file, less
+	// than the size of the mapping if the file was truncated since
+	[[nodiscard]] size_t intact() const noexcept;
+
+	// hint that the given range will be read soon
+	void willNeed(size_t Offset, size_t Size) const noexcept;
+
+private:
+	void * Address_;
+	size_t Size_;
+	int File_; // kept open to check on the size, -1 on Windows
+	catalog::FileStamp Stamp_;
+};
+} // namespace mapping
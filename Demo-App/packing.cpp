@@ -0,0 +1,263 @@
+module;
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <span>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#	include <emmintrin.h>
+#endif
+
+module video.packing;
+
+using namespace std; // bad practice - only for presentation!
+
+namespace packing {
+
+static constexpr uint8_t Literal = 0x00;
+static constexpr uint8_t Run     = 0x40;
+static constexpr uint8_t Index   = 0x80;
+static constexpr uint8_t LongRun = 0xC0;
+static constexpr uint8_t OpMask  = 0xC0;
+
+static constexpr size_t MaxShort = 64;
+static constexpr size_t MinLong  = MaxShort + 1;
+static constexpr size_t MaxLong  = (size_t{ 0x3F } << 8 | 0xFF) + MinLong;
+static constexpr size_t Slots    = 64;
+
+template <typename T>
+static T load(const std::byte * In) noexcept {
+	T Value;
+	memcpy(&Value, In, sizeof(T));
+	return Value;
+}
+template <typename T>
+static void store(std::byte * Out, T Value) noexcept {
+	memcpy(Out, &Value, sizeof(T));
+}
+
+static constexpr uint8_t slot(uint32_t Element) noexcept {
+	return static_cast<uint8_t>((Element * 2654435761u) >> 26);
+}
+
+#if defined(__SSE2__) || defined(_M_X64)
+template <typename T>
+static __m128i splat(T Value) noexcept {
+	if constexpr (sizeof(T) == 1)
+		return _mm_set1_epi8(static_cast<char>(Value));
+	else
+		return _mm_set1_epi32(static_cast<int>(Value));
+}
+#endif
+
+// the number of elements from In on which are equal to Value, at most Count.
+// Compared 16 bytes at a time
+template <typename T>
+static size_t runLength(const std::byte * In, T Value, size_t Count) noexcept {
+	size_t n = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+	constexpr size_t PerVector = 16 / sizeof(T);
+	const auto Pattern         = splat(Value);
+	for (; Count - n >= PerVector; n += PerVector) {
+		const auto Vector =
+		    _mm_loadu_si128(reinterpret_cast<const __m128i *>(In));
+		const auto Equal = static_cast<unsigned>(
+		    _mm_movemask_epi8(_mm_cmpeq_epi8(Vector, Pattern)));
+		if (Equal != 0xFFFF)
+			return n + countr_one(Equal) / sizeof(T);
+		In += 16;
+	}
+#endif
+	for (; n < Count && load<T>(In) == Value; ++n)
+		In += sizeof(T);
+	return n;
+}
+
+// Count elements of Value, written 16 bytes at a time
+template <typename T>
+static void fill(std::byte * Out, T Value, size_t Count) noexcept {
+#if defined(__SSE2__) || defined(_M_X64)
+	constexpr size_t PerVector = 16 / sizeof(T);
+	const auto Pattern         = splat(Value);
+	for (; Count >= PerVector; Count -= PerVector, Out += 16)
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(Out), Pattern);
+#endif
+	for (; Count > 0; --Count, Out += sizeof(T))
+		store(Out, Value);
+}
+
+template <typename T>
+static size_t packElements(span<const std::byte> Bytes,
+                           span<std::byte> Space) noexcept {
+	const auto Count = Bytes.size() / sizeof(T);
+	const auto * In  = Bytes.data();
+	auto * Out       = Space.data() + HeaderSize;
+	auto * const End = Space.data() + Space.size();
+	const auto fits  = [&](size_t Size) {
+		return static_cast<size_t>(End - Out) >= Size;
+	};
+
+	array<T, Slots> Table{};
+	T Previous           = 0;
+	std::byte * Literals = nullptr; // the op of the pending literals
+	size_t Pending       = 0;
+
+	for (size_t i = 0; i < Count;) {
+		const auto Repeats = runLength(In, Previous, Count - i);
+		if (Repeats > 0) {
+			Pending = 0;
+			for (auto n = Repeats; n > 0;) {
+				if (n > MaxShort) {
+					const auto Length = min(n, MaxLong) - MinLong;
+					if (!fits(2))
+						return 0;
+					*Out++ = std::byte(LongRun | Length >> 8);
+					*Out++ = std::byte(Length & 0xFF);
+					n -= Length + MinLong;
+				} else {
+					if (!fits(1))
+						return 0;
+					*Out++ = std::byte(Run | (n - 1));
+					n      = 0;
+				}
+			}
+			i += Repeats;
+			In += Repeats * sizeof(T);
+			continue;
+		}
+
+		const auto Element = load<T>(In);
+		Previous           = Element;
+		++i;
+		In += sizeof(T);
+		if constexpr (sizeof(T) == 4) {
+			auto & Seen = Table[slot(Element)];
+			if (Seen == Element) {
+				if (!fits(1))
+					return 0;
+				*Out++  = std::byte(Index | slot(Element));
+				Pending = 0;
+				continue;
+			}
+			Seen = Element;
+		}
+		if (Pending == 0 || Pending == MaxShort) {
+			if (!fits(1))
+				return 0;
+			Literals = Out++;
+			Pending  = 0;
+		}
+		if (!fits(sizeof(T)))
+			return 0;
+		store(Out, Element);
+		Out += sizeof(T);
+		*Literals = std::byte(Literal | Pending++);
+	}
+
+	const auto Rest = Bytes.size() - Count * sizeof(T);
+	if (!fits(Rest))
+		return 0;
+	if (Rest > 0)
+		memcpy(Out, In, Rest);
+	return static_cast<size_t>(Out + Rest - Space.data());
+}
+
+template <typename T>
+static bool unpackElements(span<const std::byte> Ops,
+                           span<std::byte> Space) noexcept {
+	const auto Count       = Space.size() / sizeof(T);
+	const auto * In        = Ops.data();
+	const auto * const End = In + Ops.size();
+	auto * Out             = Space.data();
+
+	array<T, Slots> Table{};
+	T Previous = 0;
+	for (size_t i = 0; i < Count;) {
+		if (In == End)
+			return false;
+		const auto Op = to_integer<uint8_t>(*In++);
+		auto n        = size_t{ Op & 0x3Fu } + 1;
+		switch (Op & OpMask) {
+			case Literal: {
+				if (n > Count - i ||
+				    static_cast<size_t>(End - In) < n * sizeof(T))
+					return false;
+				memcpy(Out, In, n * sizeof(T));
+				if constexpr (sizeof(T) == 4) {
+					for (size_t k = 0; k < n; ++k) {
+						const auto Element   = load<T>(In + k * sizeof(T));
+						Table[slot(Element)] = Element;
+					}
+				}
+				Previous = load<T>(In + (n - 1) * sizeof(T));
+				In += n * sizeof(T);
+				break;
+			}
+			case Index:
+				if constexpr (sizeof(T) != 4)
+					return false;
+				Previous = Table[Op & 0x3F];
+				n        = 1;
+				store(Out, Previous);
+				break;
+			case LongRun:
+				if (In == End)
+					return false;
+				n = ((n - 1) << 8 | to_integer<size_t>(*In++)) + MinLong;
+				[[fallthrough]];
+			case Run:
+				if (n > Count - i)
+					return false;
+				fill(Out, Previous, n);
+				break;
+		}
+		i += n;
+		Out += n * sizeof(T);
+	}
+
+	const auto Rest = Space.size() - Count * sizeof(T);
+	if (static_cast<size_t>(End - In) != Rest)
+		return false;
+	if (Rest > 0)
+		memcpy(Out, In, Rest);
+	return true;
+}
+
+//------------------------------------------------------------------------------
+
+size_t pack(span<const std::byte> Bytes, unsigned Element,
+            span<std::byte> Space) noexcept {
+	if (Bytes.empty() || Space.size() < HeaderSize ||
+	    (Element != 1 && Element != 4))
+		return 0;
+	for (size_t i = 0; i < 8; ++i)
+		Space[i] = static_cast<std::byte>(uint64_t{ Bytes.size() } >> (8 * i));
+	Space[8] = static_cast<std::byte>(Element);
+	return Element == 1 ? packElements<uint8_t>(Bytes, Space)
+	                    : packElements<uint32_t>(Bytes, Space);
+}
+
+size_t unpackedSize(span<const std::byte> Packed) noexcept {
+	if (Packed.size() < HeaderSize)
+		return 0;
+	const auto Element = to_integer<uint8_t>(Packed[8]);
+	if (Element != 1 && Element != 4)
+		return 0;
+	uint64_t Size = 0;
+	for (size_t i = 0; i < 8; ++i)
+		Size |= to_integer<uint64_t>(Packed[i]) << (8 * i);
+	return Size <= SIZE_MAX ? static_cast<size_t>(Size) : 0;
+}
+
+bool unpack(span<const std::byte> Packed, span<std::byte> Space) noexcept {
+	if (Space.empty() || unpackedSize(Packed) != Space.size())
+		return false;
+	const auto Ops = Packed.subspan(HeaderSize);
+	return to_integer<uint8_t>(Packed[8]) == 1
+	           ? unpackElements<uint8_t>(Ops, Space)
+	           : unpackElements<uint32_t>(Ops, Space);
+}
+} // namespace packing
@@ -0,0 +1,46 @@
+module;
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+export module video.packing;
+
+using namespace std; // bad practice - only for presentation!
+
+// a lossless codec for frame payloads in the spirit of QOI: runs of repeated
+// elements, recently seen elements, and literals. Frames from GIFs with their
+// large flat areas and few colours shrink a lot, at a speed close to memcpy.
+// Elements are the pixels of the payload, 1 byte for indexed frames and 4
+// bytes otherwise
+//
+//   header: uint64 unpacked size (little-endian), uint8 element size
+//   ops:    00nnnnnn  n + 1 literal elements follow
+//           01nnnnnn  the element before, repeated n + 1 times
+//           10iiiiii  the element in slot i of the table of recently seen
+//                     elements (4-byte elements only)
+//           11nnnnnn  followed by byte m: the element before, repeated
+//                     (n << 8 | m) + 65 times
+//   the bytes beyond the last whole element follow the ops verbatim
+//
+// the element before the first one is all zeros, the table starts out all
+// zeros
+
+namespace packing {
+
+export constexpr size_t HeaderSize = 9;
+
+// pack Bytes into Space, with elements of the given size (1 or 4 bytes).
+// The size of the packed bytes, 0 if they don't fit into Space. Packing gives
+// up as soon as it runs out of space, a small Space keeps the effort low for
+// payloads which don't pack well
+export [[nodiscard]] size_t pack(span<const std::byte> Bytes, unsigned Element,
+                                 span<std::byte> Space) noexcept;
+
+// the size of the bytes packed into Packed, 0 if this is no packing at all
+export [[nodiscard]] size_t unpackedSize(span<const std::byte> Packed) noexcept;
+
+// unpack into Space, which must have the unpacked size. False if Packed is
+// corrupted
+export [[nodiscard]] bool unpack(span<const std::byte> Packed,
+                                 span<std::byte> Space) noexcept;
+} // namespace packing
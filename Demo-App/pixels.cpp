@@ -0,0 +1,467 @@
+module;
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <string_view>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#	define X86 1
+#	include <immintrin.h>
+#	ifdef _MSC_VER
+#		include <intrin.h>
+#	else
+#		include <cpuid.h>
+#	endif
+#else
+#	define X86 0
+#endif
+
+// the variants beyond the baseline of the target are compiled for their
+// instruction set extension function by function
+#if defined(__GNUC__) || defined(__clang__)
+#	define TARGET(Extensions) __attribute__((target(Extensions)))
+#else
+#	define TARGET(Extensions)
+#endif
+
+module video.pixels;
+
+using namespace std; // bad practice - only for presentation!
+
+namespace pixels {
+
+static constexpr uint32_t AlphaMask = 0xFF000000;
+
+static uint32_t load(const std::byte * In) noexcept {
+	uint32_t Pixel;
+	memcpy(&Pixel, In, 4);
+	return Pixel;
+}
+static void store(std::byte * Out, uint32_t Pixel) noexcept {
+	memcpy(Out, &Pixel, 4);
+}
+
+//------------------------------------------------------------------------------
+// scalar
+
+static uint32_t swizzle(uint32_t Pixel) noexcept {
+	return (Pixel & 0xFF00FF00) | (Pixel >> 16 & 0xFF) | (Pixel & 0xFF) << 16;
+}
+
+// exact for all products of two bytes
+static uint32_t div255(uint32_t Value) noexcept {
+	Value += 128;
+	return (Value + (Value >> 8)) >> 8;
+}
+
+static uint32_t blendOver(uint32_t Pixel, uint32_t Background) noexcept {
+	const auto Alpha = Pixel >> 24;
+	uint32_t Result  = AlphaMask;
+	for (unsigned Shift = 0; Shift < 24; Shift += 8) {
+		const auto Colour = Pixel >> Shift & 0xFF;
+		const auto Behind = Background >> Shift & 0xFF;
+		Result |= div255(Colour * Alpha + Behind * (255 - Alpha)) << Shift;
+	}
+	return Result;
+}
+
+static void swizzleScalar(const std::byte * In, std::byte * Out,
+                          size_t Pixels) noexcept {
+	for (; Pixels > 0; --Pixels, In += 4, Out += 4)
+		store(Out, swizzle(load(In)));
+}
+
+static void expandScalar(const std::byte * Indices, std::byte * Out,
+                         size_t Pixels, const uint32_t * Palette) noexcept {
+	for (; Pixels > 0; --Pixels, ++Indices, Out += 4)
+		store(Out, Palette[to_integer<uint8_t>(*Indices)]);
+}
+
+static void blendScalar(const std::byte * In, std::byte * Out, size_t Pixels,
+                        uint32_t Background) noexcept {
+	for (; Pixels > 0; --Pixels, In += 4, Out += 4)
+		store(Out, blendOver(load(In), Background));
+}
+
+static void widenScalar(const std::byte * In, std::byte * Out, size_t Pixels,
+                        unsigned Factor) noexcept {
+	for (; Pixels > 0; --Pixels, In += 4)
+		for (unsigned i = 0; i < Factor; ++i, Out += 4)
+			memcpy(Out, In, 4);
+}
+
+#if X86
+//------------------------------------------------------------------------------
+// SSE2, 4 pixels at a time. SSE2 has no gathers, palettes are expanded by the
+// scalar code
+
+static void swizzleSSE2(const std::byte * In, std::byte * Out,
+                        size_t Pixels) noexcept {
+	const auto Keep = _mm_set1_epi32(static_cast<int>(0xFF00FF00));
+	const auto Low  = _mm_set1_epi32(0xFF);
+	for (; Pixels >= 4; Pixels -= 4, In += 16, Out += 16) {
+		const auto P = _mm_loadu_si128(reinterpret_cast<const __m128i *>(In));
+		const auto R = _mm_or_si128(
+		    _mm_and_si128(P, Keep),
+		    _mm_or_si128(_mm_and_si128(_mm_srli_epi32(P, 16), Low),
+		                 _mm_slli_epi32(_mm_and_si128(P, Low), 16)));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(Out), R);
+	}
+	swizzleScalar(In, Out, Pixels);
+}
+
+// 8 channels of 2 pixels, widened to 16 bits
+static __m128i blend16(__m128i Pixels, __m128i Behind) noexcept {
+	const auto Alpha = _mm_shufflehi_epi16(
+	    _mm_shufflelo_epi16(Pixels, _MM_SHUFFLE(3, 3, 3, 3)),
+	    _MM_SHUFFLE(3, 3, 3, 3));
+	const auto Rest = _mm_sub_epi16(_mm_set1_epi16(255), Alpha);
+	auto Sum        = _mm_add_epi16(_mm_mullo_epi16(Pixels, Alpha),
+	                                _mm_mullo_epi16(Behind, Rest));
+	Sum             = _mm_add_epi16(Sum, _mm_set1_epi16(128));
+	return _mm_srli_epi16(_mm_add_epi16(Sum, _mm_srli_epi16(Sum, 8)), 8);
+}
+
+static void blendSSE2(const std::byte * In, std::byte * Out, size_t Pixels,
+                      uint32_t Background) noexcept {
+	const auto Zero   = _mm_setzero_si128();
+	const auto Behind = _mm_unpacklo_epi8(
+	    _mm_set1_epi32(static_cast<int>(Background)), Zero);
+	const auto Opaque = _mm_set1_epi32(static_cast<int>(AlphaMask));
+	for (; Pixels >= 4; Pixels -= 4, In += 16, Out += 16) {
+		const auto P = _mm_loadu_si128(reinterpret_cast<const __m128i *>(In));
+		const auto Lo = blend16(_mm_unpacklo_epi8(P, Zero), Behind);
+		const auto Hi = blend16(_mm_unpackhi_epi8(P, Zero), Behind);
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(Out),
+		                 _mm_or_si128(_mm_packus_epi16(Lo, Hi), Opaque));
+	}
+	blendScalar(In, Out, Pixels, Background);
+}
+
+// doubled pixels are interleaved with themselves, larger factors are written
+// as splats of 4 pixels, the last one of them overlapping the one before
+static void widenSSE2(const std::byte * In, std::byte * Out, size_t Pixels,
+                      unsigned Factor) noexcept {
+	if (Factor == 2) {
+		for (; Pixels >= 4; Pixels -= 4, In += 16, Out += 32) {
+			const auto P =
+			    _mm_loadu_si128(reinterpret_cast<const __m128i *>(In));
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(Out),
+			                 _mm_unpacklo_epi32(P, P));
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(Out + 16),
+			                 _mm_unpackhi_epi32(P, P));
+		}
+	} else if (Factor >= 4) {
+		for (; Pixels > 0; --Pixels, In += 4, Out += 4 * Factor) {
+			const auto P = _mm_set1_epi32(static_cast<int>(load(In)));
+			for (unsigned i = 0; i < Factor - 4; i += 4)
+				_mm_storeu_si128(reinterpret_cast<__m128i *>(Out + 4 * i), P);
+			_mm_storeu_si128(
+			    reinterpret_cast<__m128i *>(Out + 4 * (Factor - 4)), P);
+		}
+	}
+	widenScalar(In, Out, Pixels, Factor);
+}
+
+//------------------------------------------------------------------------------
+// AVX2, 8 pixels at a time
+
+TARGET("avx2")
+static void swizzleAVX2(const std::byte * In, std::byte * Out,
+                        size_t Pixels) noexcept {
+	const auto Order = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11,
+	                                    14, 13, 12, 15, 2, 1, 0, 3, 6, 5, 4, 7,
+	                                    10, 9, 8, 11, 14, 13, 12, 15);
+	for (; Pixels >= 8; Pixels -= 8, In += 32, Out += 32) {
+		const auto P =
+		    _mm256_loadu_si256(reinterpret_cast<const __m256i *>(In));
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(Out),
+		                    _mm256_shuffle_epi8(P, Order));
+	}
+	swizzleScalar(In, Out, Pixels);
+}
+
+TARGET("avx2")
+static void expandAVX2(const std::byte * Indices, std::byte * Out,
+                       size_t Pixels, const uint32_t * Palette) noexcept {
+	const auto * Table = reinterpret_cast<const int *>(Palette);
+	for (; Pixels >= 8; Pixels -= 8, Indices += 8, Out += 32) {
+		const auto Index = _mm256_cvtepu8_epi32(
+		    _mm_loadl_epi64(reinterpret_cast<const __m128i *>(Indices)));
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(Out),
+		                    _mm256_i32gather_epi32(Table, Index, 4));
+	}
+	expandScalar(Indices, Out, Pixels, Palette);
+}
+
+TARGET("avx2")
+static __m256i blend16(__m256i Pixels, __m256i Behind) noexcept {
+	const auto Alpha = _mm256_shufflehi_epi16(
+	    _mm256_shufflelo_epi16(Pixels, _MM_SHUFFLE(3, 3, 3, 3)),
+	    _MM_SHUFFLE(3, 3, 3, 3));
+	const auto Rest = _mm256_sub_epi16(_mm256_set1_epi16(255), Alpha);
+	auto Sum        = _mm256_add_epi16(_mm256_mullo_epi16(Pixels, Alpha),
+	                                   _mm256_mullo_epi16(Behind, Rest));
+	Sum             = _mm256_add_epi16(Sum, _mm256_set1_epi16(128));
+	return _mm256_srli_epi16(_mm256_add_epi16(Sum, _mm256_srli_epi16(Sum, 8)),
+	                         8);
+}
+
+TARGET("avx2")
+static void blendAVX2(const std::byte * In, std::byte * Out, size_t Pixels,
+                      uint32_t Background) noexcept {
+	const auto Zero   = _mm256_setzero_si256();
+	const auto Behind = _mm256_unpacklo_epi8(
+	    _mm256_set1_epi32(static_cast<int>(Background)), Zero);
+	const auto Opaque = _mm256_set1_epi32(static_cast<int>(AlphaMask));
+	for (; Pixels >= 8; Pixels -= 8, In += 32, Out += 32) {
+		const auto P =
+		    _mm256_loadu_si256(reinterpret_cast<const __m256i *>(In));
+		const auto Lo = blend16(_mm256_unpacklo_epi8(P, Zero), Behind);
+		const auto Hi = blend16(_mm256_unpackhi_epi8(P, Zero), Behind);
+		_mm256_storeu_si256(
+		    reinterpret_cast<__m256i *>(Out),
+		    _mm256_or_si256(_mm256_packus_epi16(Lo, Hi), Opaque));
+	}
+	blendScalar(In, Out, Pixels, Background);
+}
+
+TARGET("avx2")
+static void widenAVX2(const std::byte * In, std::byte * Out, size_t Pixels,
+                      unsigned Factor) noexcept {
+	if (Factor == 2) {
+		for (; Pixels >= 8; Pixels -= 8, In += 32, Out += 64) {
+			const auto P =
+			    _mm256_loadu_si256(reinterpret_cast<const __m256i *>(In));
+			const auto Lo = _mm256_unpacklo_epi32(P, P);
+			const auto Hi = _mm256_unpackhi_epi32(P, P);
+			_mm256_storeu_si256(reinterpret_cast<__m256i *>(Out),
+			                    _mm256_permute2x128_si256(Lo, Hi, 0x20));
+			_mm256_storeu_si256(reinterpret_cast<__m256i *>(Out + 32),
+			                    _mm256_permute2x128_si256(Lo, Hi, 0x31));
+		}
+	} else if (Factor >= 8) {
+		for (; Pixels > 0; --Pixels, In += 4, Out += 4 * Factor) {
+			const auto P = _mm256_set1_epi32(static_cast<int>(load(In)));
+			for (unsigned i = 0; i < Factor - 8; i += 8)
+				_mm256_storeu_si256(reinterpret_cast<__m256i *>(Out + 4 * i),
+				                    P);
+			_mm256_storeu_si256(
+			    reinterpret_cast<__m256i *>(Out + 4 * (Factor - 8)), P);
+		}
+	}
+	widenSSE2(In, Out, Pixels, Factor);
+}
+
+//------------------------------------------------------------------------------
+// AVX-512 (F and BW), 16 pixels at a time
+
+TARGET("avx512f,avx512bw")
+static void swizzleAVX512(const std::byte * In, std::byte * Out,
+                          size_t Pixels) noexcept {
+	const auto Order = _mm512_broadcast_i32x4(
+	    _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15));
+	for (; Pixels >= 16; Pixels -= 16, In += 64, Out += 64)
+		_mm512_storeu_si512(Out,
+		                    _mm512_shuffle_epi8(_mm512_loadu_si512(In), Order));
+	swizzleScalar(In, Out, Pixels);
+}
+
+TARGET("avx512f,avx512bw")
+static void expandAVX512(const std::byte * Indices, std::byte * Out,
+                         size_t Pixels, const uint32_t * Palette) noexcept {
+	for (; Pixels >= 16; Pixels -= 16, Indices += 16, Out += 64) {
+		const auto Index = _mm512_cvtepu8_epi32(
+		    _mm_loadu_si128(reinterpret_cast<const __m128i *>(Indices)));
+		_mm512_storeu_si512(Out, _mm512_i32gather_epi32(Index, Palette, 4));
+	}
+	expandScalar(Indices, Out, Pixels, Palette);
+}
+
+TARGET("avx512f,avx512bw")
+static __m512i blend16(__m512i Pixels, __m512i Behind) noexcept {
+	const auto Alpha = _mm512_shufflehi_epi16(
+	    _mm512_shufflelo_epi16(Pixels, _MM_SHUFFLE(3, 3, 3, 3)),
+	    _MM_SHUFFLE(3, 3, 3, 3));
+	const auto Rest = _mm512_sub_epi16(_mm512_set1_epi16(255), Alpha);
+	auto Sum        = _mm512_add_epi16(_mm512_mullo_epi16(Pixels, Alpha),
+	                                   _mm512_mullo_epi16(Behind, Rest));
+	Sum             = _mm512_add_epi16(Sum, _mm512_set1_epi16(128));
+	return _mm512_srli_epi16(_mm512_add_epi16(Sum, _mm512_srli_epi16(Sum, 8)),
+	                         8);
+}
+
+TARGET("avx512f,avx512bw")
+static void blendAVX512(const std::byte * In, std::byte * Out, size_t Pixels,
+                        uint32_t Background) noexcept {
+	const auto Zero   = _mm512_setzero_si512();
+	const auto Behind = _mm512_unpacklo_epi8(
+	    _mm512_set1_epi32(static_cast<int>(Background)), Zero);
+	const auto Opaque = _mm512_set1_epi32(static_cast<int>(AlphaMask));
+	for (; Pixels >= 16; Pixels -= 16, In += 64, Out += 64) {
+		const auto P  = _mm512_loadu_si512(In);
+		const auto Lo = blend16(_mm512_unpacklo_epi8(P, Zero), Behind);
+		const auto Hi = blend16(_mm512_unpackhi_epi8(P, Zero), Behind);
+		_mm512_storeu_si512(
+		    Out, _mm512_or_si512(_mm512_packus_epi16(Lo, Hi), Opaque));
+	}
+	blendScalar(In, Out, Pixels, Background);
+}
+
+TARGET("avx512f,avx512bw")
+static void widenAVX512(const std::byte * In, std::byte * Out, size_t Pixels,
+                        unsigned Factor) noexcept {
+	if (Factor == 2) {
+		const auto Lo = _mm512_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5,
+		                                  6, 6, 7, 7);
+		const auto Hi = _mm512_add_epi32(Lo, _mm512_set1_epi32(8));
+		for (; Pixels >= 16; Pixels -= 16, In += 64, Out += 128) {
+			const auto P = _mm512_loadu_si512(In);
+			_mm512_storeu_si512(Out, _mm512_permutexvar_epi32(Lo, P));
+			_mm512_storeu_si512(Out + 64, _mm512_permutexvar_epi32(Hi, P));
+		}
+	} else if (Factor >= 16) {
+		for (; Pixels > 0; --Pixels, In += 4, Out += 4 * Factor) {
+			const auto P = _mm512_set1_epi32(static_cast<int>(load(In)));
+			for (unsigned i = 0; i < Factor - 16; i += 16)
+				_mm512_storeu_si512(Out + 4 * i, P);
+			_mm512_storeu_si512(Out + 4 * (Factor - 16), P);
+		}
+	}
+	widenAVX2(In, Out, Pixels, Factor);
+}
+
+//------------------------------------------------------------------------------
+// what the CPU and the operating system support
+
+struct Registers {
+	unsigned A_, B_, C_, D_;
+};
+
+static Registers cpuid(unsigned Leaf, unsigned Subleaf = 0) noexcept {
+#	ifdef _MSC_VER
+	int Result[4];
+	__cpuidex(Result, static_cast<int>(Leaf), static_cast<int>(Subleaf));
+	return { static_cast<unsigned>(Result[0]), static_cast<unsigned>(Result[1]),
+		     static_cast<unsigned>(Result[2]),
+		     static_cast<unsigned>(Result[3]) };
+#	else
+	Registers Result{};
+	__cpuid_count(Leaf, Subleaf, Result.A_, Result.B_, Result.C_, Result.D_);
+	return Result;
+#	endif
+}
+
+// the register state saved by the operating system
+static uint64_t xgetbv() noexcept {
+#	ifdef _MSC_VER
+	return _xgetbv(0);
+#	else
+	unsigned Low, High;
+	__asm__("xgetbv" : "=a"(Low), "=d"(High) : "c"(0));
+	return uint64_t{ High } << 32 | Low;
+#	endif
+}
+
+static Level detect() noexcept {
+	if (cpuid(0).A_ < 7)
+		return Level::SSE2; // the baseline of x64
+	const auto Features = cpuid(1);
+	if ((Features.C_ & (1u << 27)) == 0) // no xgetbv
+		return Level::SSE2;
+	const auto State    = xgetbv();
+	const auto Extended = cpuid(7);
+	const bool AVX2     = (State & 0x06) == 0x06 && (Extended.B_ & (1u << 5));
+	const bool AVX512   = AVX2 && (State & 0xE0) == 0xE0 &&
+	                    (Extended.B_ & (1u << 16)) &&
+	                    (Extended.B_ & (1u << 30));
+	return AVX512 ? Level::AVX512 : AVX2 ? Level::AVX2 : Level::SSE2;
+}
+#else
+static Level detect() noexcept {
+	return Level::Scalar;
+}
+#endif
+
+//------------------------------------------------------------------------------
+// the variants of a level
+
+struct Kernels {
+	Level Level_;
+	void (*Swizzle_)(const std::byte *, std::byte *, size_t) noexcept;
+	void (*Expand_)(const std::byte *, std::byte *, size_t,
+	                const uint32_t *) noexcept;
+	void (*Blend_)(const std::byte *, std::byte *, size_t, uint32_t) noexcept;
+	void (*Widen_)(const std::byte *, std::byte *, size_t, unsigned) noexcept;
+};
+
+static constexpr Kernels Variants[] = {
+	{ Level::Scalar, swizzleScalar, expandScalar, blendScalar, widenScalar },
+#if X86
+	{ Level::SSE2, swizzleSSE2, expandScalar, blendSSE2, widenSSE2 },
+	{ Level::AVX2, swizzleAVX2, expandAVX2, blendAVX2, widenAVX2 },
+	{ Level::AVX512, swizzleAVX512, expandAVX512, blendAVX512, widenAVX512 },
+#endif
+};
+
+static const Level Supported = detect();
+static atomic<const Kernels *> Active =
+    &Variants[static_cast<size_t>(Supported)];
+
+Level level() noexcept {
+	return Active.load(memory_order_relaxed)->Level_;
+}
+
+bool use(Level Wanted) noexcept {
+	if (Wanted > Supported)
+		return false;
+	Active.store(&Variants[static_cast<size_t>(Wanted)],
+	             memory_order_relaxed);
+	return true;
+}
+
+string_view name(Level Which) noexcept {
+	switch (Which) {
+		case Level::Scalar: return "scalar";
+		case Level::SSE2: return "SSE2";
+		case Level::AVX2: return "AVX2";
+		case Level::AVX512: return "AVX-512";
+	}
+	return {};
+}
+
+void swizzle(const std::byte * In, std::byte * Out, size_t Pixels) noexcept {
+	Active.load(memory_order_relaxed)->Swizzle_(In, Out, Pixels);
+}
+
+void expandPalette(const std::byte * Indices, std::byte * Out, size_t Pixels,
+                   span<const uint32_t, 256> Palette) noexcept {
+	Active.load(memory_order_relaxed)->Expand_(Indices, Out, Pixels,
+	                                           Palette.data());
+}
+
+void blendOver(const std::byte * In, std::byte * Out, size_t Pixels,
+               uint32_t Background) noexcept {
+	Active.load(memory_order_relaxed)->Blend_(In, Out, Pixels, Background);
+}
+
+void widen(const std::byte * In, std::byte * Out, size_t Pixels,
+           unsigned Factor) noexcept {
+	if (Factor == 1)
+		memcpy(Out, In, 4 * Pixels);
+	else
+		Active.load(memory_order_relaxed)->Widen_(In, Out, Pixels, Factor);
+}
+
+void copyRows(const std::byte * In, size_t InPitch, std::byte * Out,
+              size_t OutPitch, size_t Bytes, size_t Rows) noexcept {
+	if (InPitch == Bytes && OutPitch == Bytes) {
+		memcpy(Out, In, Bytes * Rows);
+		return;
+	}
+	for (; Rows > 0; --Rows, In += InPitch, Out += OutPitch)
+		memcpy(Out, In, Bytes);
+}
+} // namespace pixels
@@ -0,0 +1,48 @@
+module;
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string_view>
+
+export module video.pixels;
+
+using namespace std; // bad practice - only for presentation!
+
+// pixel kernels for the hot loops on either end of the wire, in variants for
+// the instruction set extensions up to AVX-512. The best variant the CPU
+// supports is chosen at runtime, the others remain available for comparison.
+// Pixels are 4 bytes with alpha in the highest byte, ARGB8888 or ABGR8888 in
+// terms of SDL. Swizzling and blending may work in place, the input and output
+// of the other kernels must not overlap
+
+namespace pixels {
+
+export enum class Level : unsigned char { Scalar, SSE2, AVX2, AVX512 };
+
+// the variants in use
+export [[nodiscard]] Level level() noexcept;
+// use the variants of the given level, false if the CPU doesn't support them
+export bool use(Level Wanted) noexcept;
+export [[nodiscard]] string_view name(Level Which) noexcept;
+
+// swap the red and the blue bytes, RGBA <-> BGRA
+export void swizzle(const std::byte * In, std::byte * Out,
+                    size_t Pixels) noexcept;
+
+// look up the indices in a palette
+export void expandPalette(const std::byte * Indices, std::byte * Out,
+                          size_t Pixels,
+                          span<const uint32_t, 256> Palette) noexcept;
+
+// blend the pixels over an opaque background of the same format
+export void blendOver(const std::byte * In, std::byte * Out, size_t Pixels,
+                      uint32_t Background) noexcept;
+
+// repeat each pixel Factor times, a row scaled up to the nearest neighbours
+export void widen(const std::byte * In, std::byte * Out, size_t Pixels,
+                  unsigned Factor) noexcept;
+
+// copy rows of Bytes each, in a single go if both ends are tightly packed
+export void copyRows(const std::byte * In, size_t InPitch, std::byte * Out,
+                     size_t OutPitch, size_t Bytes, size_t Rows) noexcept;
+} // namespace pixels
@@ -1,8 +1,16 @@
 ﻿module;
+#include <array>
+#include <bit>
 #include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
 #include <span>
 #include <type_traits>
 
+#include "c_resource.hpp"
+
 export module video;
 import libav;
 
@@ -11,7 +19,51 @@ using namespace std::chrono;
 
 export
 namespace video {
-enum PixelFormat : unsigned char { invalid, RGBA, BGRA };
+enum PixelFormat : unsigned char { invalid, RGBA, BGRA, PAL8 };
+
+// indexed (PAL8) frames carry a palette of 256 colours in front of the pixel
+// indices, each colour with its bytes in B, G, R, A order
+constexpr auto PaletteEntries = 256u;
+constexpr auto PaletteBytes   = PaletteEntries * 4u;
+
+// frames are sent in full, or as the difference to the frame before: either
+// the rectangles which have changed, or nothing at all if the frame repeats.
+// Peers which decode themselves may get the compressed packet a frame is
+// decoded from instead. The kind of frame is kept in the lowest bits of
+// FrameHeader::Flags_
+enum FrameKind : uint16_t { Full = 0, Delta = 1, Repeat = 2, Packet = 3 };
+constexpr uint16_t KindMask = 0x0003;
+
+// the first packet of a stream starts with a StreamHeader, followed by the
+// codec's extradata, followed by the packet itself
+constexpr uint16_t NewStream = 0x0004;
+
+struct StreamHeader {
+	uint32_t Codec_; // AVCodecID
+	int32_t Width_;
+	int32_t Height_;
+	uint32_t ExtraSize_;
+};
+// packets are hardly ever larger than the frame they decode to, this leaves
+// room for the odd one and for the codec parameters
+constexpr size_t PacketSlack = 64 * 1024;
+
+// the payload is packed losslessly (see module video.packing), the payload
+// size is the packed size. Unpacked, the payload is that of the frame kind
+constexpr uint16_t Packed = 0x0008;
+
+// the payload of a delta frame starts with a DeltaHeader, followed by the
+// rectangles, followed by the pixel rows of the rectangles, packed tightly
+struct DeltaHeader {
+	uint32_t Rects_;
+	uint32_t Bytes_; // rectangles plus pixels
+};
+struct Rect {
+	uint16_t X_;
+	uint16_t Y_;
+	uint16_t Width_;
+	uint16_t Height_;
+};
 
 PixelFormat fromLibav(int Format) {
 	switch (Format) {
@@ -21,23 +73,45 @@ PixelFormat fromLibav(int Format) {
 	}
 }
 
-struct FrameHeader {
-	static constexpr auto Size = 16u;
+// the in-memory frame header. On the wire, it is encoded in one of two
+// versions, see below
 
-	using µSeconds = duration<unsigned, micro>;
+struct FrameHeader {
+	using µSeconds = duration<uint64_t, micro>;
 
-	int Width_ : 16;
-	int Height_ : 16;
-	int LinePitch_ : 16;
-	int Format_ : 8;
-	int Sequence_;
+	int32_t Width_;
+	int32_t Height_;
+	int32_t LinePitch_;
+	PixelFormat Format_;
+	uint16_t Flags_;
+	int32_t Sequence_;
 	µSeconds Timestamp_;
+	uint64_t PayloadSize_;
 
-	[[nodiscard]] constexpr size_t size() const noexcept {
+	[[nodiscard]] constexpr PixelFormat format() const noexcept {
+		return Format_;
+	}
+	[[nodiscard]] constexpr FrameKind kind() const noexcept {
+		return static_cast<FrameKind>(Flags_ & KindMask);
+	}
+	[[nodiscard]] constexpr size_t pixels() const noexcept {
 		return static_cast<size_t>(Height_) * LinePitch_;
 	}
+	// the payload size of a full frame with this geometry and format
+	[[nodiscard]] constexpr size_t frameSize() const noexcept {
+		return Format_ == PAL8 && pixels() > 0 ? PaletteBytes + pixels()
+		                                        : pixels();
+	}
+	// the payload size on the wire
+	[[nodiscard]] constexpr size_t size() const noexcept {
+		return static_cast<size_t>(PayloadSize_);
+	}
+	// the largest payload size that makes sense
+	[[nodiscard]] constexpr size_t maxSize() const noexcept {
+		return kind() == Packet ? frameSize() + PacketSlack : frameSize();
+	}
 	[[nodiscard]] constexpr bool empty() const noexcept {
-		return size() == 0;
+		return pixels() == 0;
 	}
 	[[nodiscard]] constexpr bool filler() const noexcept {
 		return Sequence_ == 0 && Timestamp_.count() > 0;
@@ -46,14 +120,333 @@ struct FrameHeader {
 		return Sequence_ == 0 && Timestamp_.count() == 0;
 	}
 };
-static_assert(sizeof(FrameHeader) == FrameHeader::Size);
 static_assert(is_trivial_v<FrameHeader>); // guarantee relocatability!
 
+//------------------------------------------------------------------------------
+// the wire formats of the frame header, all fields little-endian
+//
+// version 1, 16 bytes, the layout of the original bitfield struct
+//   0 int16 width       2 int16 height    4 int16 line pitch
+//   6 uint8 format, the frame kind in bit 5 (delta) and bit 6 (repeat)
+//   7 padding           8 int32 sequence 12 uint32 timestamp [µs]
+//   the payload size is implied by geometry and format, the payload of delta
+//   frames starts with a DeltaHeader which tells the rest
+//
+// version 2, 40 bytes
+//   0 uint16 magic 0xFFF2, a negative width in terms of version 1
+//   2 uint8 version      3 uint8 format    4 uint16 flags
+//   6 uint16 header size 8 uint32 width   12 uint32 height
+//  16 uint32 line pitch 20 int32 sequence 24 uint64 timestamp [µs]
+//  32 uint64 payload size
+//   packets go in version 2 only, with the geometry and format of the frame
+//   they decode to. So do packed payloads
+
+namespace wire {
+constexpr size_t V1Size       = 16;
+constexpr size_t V2Size       = 40;
+constexpr uint16_t V2Magic    = 0xFFF2;
+constexpr uint8_t V1DeltaBit  = 0x20;
+constexpr uint8_t V1RepeatBit = 0x40;
+
+template <typename T>
+constexpr void put(std::byte * Out, T Value) noexcept {
+	const auto Bits = static_cast<make_unsigned_t<T>>(Value);
+	for (size_t i = 0; i < sizeof(T); ++i)
+		Out[i] = static_cast<std::byte>(Bits >> (8 * i));
+}
+
+template <typename T>
+[[nodiscard]] constexpr T get(const std::byte * In) noexcept {
+	make_unsigned_t<T> Bits = 0;
+	for (size_t i = 0; i < sizeof(T); ++i)
+		Bits |= static_cast<make_unsigned_t<T>>(
+		    to_integer<make_unsigned_t<T>>(In[i]) << (8 * i));
+	return static_cast<T>(Bits);
+}
+
+// an encoded header of either version
+struct Header {
+	array<std::byte, V2Size> Bytes_{};
+	size_t Size_ = 0;
+
+	[[nodiscard]] constexpr span<const std::byte> bytes() const noexcept {
+		return span{ Bytes_ }.first(Size_);
+	}
+};
+
+[[nodiscard]] constexpr bool fitsV1(const FrameHeader & Header) noexcept {
+	const auto fits16 = [](int32_t Value) {
+		return Value >= 0 && Value <= INT16_MAX;
+	};
+	return fits16(Header.Width_) && fits16(Header.Height_) &&
+	       fits16(Header.LinePitch_) && (Header.Flags_ & ~KindMask) == 0 &&
+	       Header.kind() != Packet && Header.Timestamp_.count() <= UINT32_MAX;
+}
+
+[[nodiscard]] constexpr Header encodeV1(const FrameHeader & Header) noexcept {
+	wire::Header Wire{ .Size_ = V1Size };
+	auto * Out  = Wire.Bytes_.data();
+	auto Format = static_cast<uint8_t>(Header.Format_);
+	if (Header.kind() == Delta)
+		Format |= V1DeltaBit;
+	else if (Header.kind() == Repeat)
+		Format |= V1RepeatBit;
+	put(Out + 0, static_cast<int16_t>(Header.Width_));
+	put(Out + 2, static_cast<int16_t>(Header.Height_));
+	put(Out + 4, static_cast<int16_t>(Header.LinePitch_));
+	put(Out + 6, Format);
+	put(Out + 8, Header.Sequence_);
+	put(Out + 12, static_cast<uint32_t>(Header.Timestamp_.count()));
+	return Wire;
+}
+
+[[nodiscard]] constexpr Header encodeV2(const FrameHeader & Header) noexcept {
+	wire::Header Wire{ .Size_ = V2Size };
+	auto * Out = Wire.Bytes_.data();
+	put(Out + 0, V2Magic);
+	put(Out + 2, uint8_t{ 2 });
+	put(Out + 3, static_cast<uint8_t>(Header.Format_));
+	put(Out + 4, Header.Flags_);
+	put(Out + 6, static_cast<uint16_t>(V2Size));
+	put(Out + 8, static_cast<uint32_t>(Header.Width_));
+	put(Out + 12, static_cast<uint32_t>(Header.Height_));
+	put(Out + 16, static_cast<uint32_t>(Header.LinePitch_));
+	put(Out + 20, Header.Sequence_);
+	put(Out + 24, Header.Timestamp_.count());
+	put(Out + 32, Header.PayloadSize_);
+	return Wire;
+}
+
+// version 1 whenever possible, such that version 1 peers keep working
+[[nodiscard]] constexpr Header encode(const FrameHeader & Header) noexcept {
+	return fitsV1(Header) ? encodeV1(Header) : encodeV2(Header);
+}
+
+// the version of a header from its first V1Size bytes, 0 if unknown
+[[nodiscard]] constexpr unsigned
+version(span<const std::byte, V1Size> Prefix) noexcept {
+	if (get<uint16_t>(Prefix.data()) != V2Magic)
+		return 1;
+	const auto Version = get<uint8_t>(Prefix.data() + 2);
+	return Version == 2 && get<uint16_t>(Prefix.data() + 6) == V2Size ? 2 : 0;
+}
+
+[[nodiscard]] constexpr FrameHeader
+decodeV1(span<const std::byte, V1Size> Wire) noexcept {
+	const auto * In    = Wire.data();
+	const auto Format  = get<uint8_t>(In + 6);
+	FrameHeader Header = {
+		.Width_     = get<int16_t>(In + 0),
+		.Height_    = get<int16_t>(In + 2),
+		.LinePitch_ = get<int16_t>(In + 4),
+		.Format_    = static_cast<PixelFormat>(Format & 0x1F),
+		.Flags_     = (Format & V1DeltaBit)    ? Delta
+		              : (Format & V1RepeatBit) ? Repeat
+		                                       : Full,
+		.Sequence_  = get<int32_t>(In + 8),
+		.Timestamp_ = FrameHeader::µSeconds{ get<uint32_t>(In + 12) },
+	};
+	Header.PayloadSize_ = Header.kind() == Delta    ? sizeof(DeltaHeader)
+	                      : Header.kind() == Repeat ? 0
+	                                                : Header.frameSize();
+	return Header;
+}
+
+[[nodiscard]] constexpr FrameHeader
+decodeV2(span<const std::byte, V2Size> Wire) noexcept {
+	const auto * In = Wire.data();
+	return {
+		.Width_       = static_cast<int32_t>(get<uint32_t>(In + 8)),
+		.Height_      = static_cast<int32_t>(get<uint32_t>(In + 12)),
+		.LinePitch_   = static_cast<int32_t>(get<uint32_t>(In + 16)),
+		.Format_      = static_cast<PixelFormat>(get<uint8_t>(In + 3)),
+		.Flags_       = get<uint16_t>(In + 4),
+		.Sequence_    = get<int32_t>(In + 20),
+		.Timestamp_   = FrameHeader::µSeconds{ get<uint64_t>(In + 24) },
+		.PayloadSize_ = get<uint64_t>(In + 32),
+	};
+}
+
+//------------------------------------------------------------------------------
+// the capability handshake
+// right after connecting, the client tells the server what it is able to
+// deal with, and the server picks the cheapest encoding within these limits
+// for every frame it sends to this client. There is no answer, every frame
+// header tells the client how to treat it. Peers which don't say hello get
+// what the first version of the protocol was able to convey
+//
+// hello, 16 bytes
+//   0 uint16 magic 0xFFF1  2 uint16 hello size   4 uint16 protocol version
+//   6 uint16 features      8 uint32 max width   12 uint32 max height
+//   a max extent of 0 means no limit. Larger hellos from future versions are
+//   accepted, the server skips what it doesn't understand
+
+enum Feature : uint16_t {
+	HeaderV2    = 0x0001, // frame headers in version 2
+	Deltas      = 0x0002, // delta and repeat frames
+	Indexed     = 0x0004, // PAL8 frames
+	Packets     = 0x0008, // compressed packets, decoded by the peer
+	Compression = 0x0010, // packed payloads
+};
+constexpr uint16_t AllFeatures =
+    HeaderV2 | Deltas | Indexed | Packets | Compression;
+
+constexpr size_t HelloSize      = 16;
+constexpr size_t MaxHelloSize   = 1024;
+constexpr uint16_t HelloMagic   = 0xFFF1;
+constexpr uint16_t ThisProtocol = 2;
+
+struct Hello {
+	uint16_t Version_   = 1;
+	uint16_t Features_  = 0; // what the first version was able to convey
+	uint32_t MaxWidth_  = 0;
+	uint32_t MaxHeight_ = 0;
+
+	[[nodiscard]] constexpr bool has(Feature Wanted) const noexcept {
+		return (Features_ & Wanted) != 0;
+	}
+	[[nodiscard]] constexpr bool
+	fits(const FrameHeader & Header) const noexcept {
+		const auto within = [](int32_t Extent, uint32_t Max) {
+			return Max == 0 || static_cast<uint32_t>(Extent) <= Max;
+		};
+		return within(Header.Width_, MaxWidth_) &&
+		       within(Header.Height_, MaxHeight_);
+	}
+};
+
+[[nodiscard]] constexpr array<std::byte, HelloSize>
+encode(const Hello & Peer) noexcept {
+	array<std::byte, HelloSize> Wire{};
+	auto * Out = Wire.data();
+	put(Out + 0, HelloMagic);
+	put(Out + 2, static_cast<uint16_t>(HelloSize));
+	put(Out + 4, Peer.Version_);
+	put(Out + 6, Peer.Features_);
+	put(Out + 8, Peer.MaxWidth_);
+	put(Out + 12, Peer.MaxHeight_);
+	return Wire;
+}
+
+// the size of the whole hello, 0 if this is no hello at all
+[[nodiscard]] constexpr size_t
+helloSize(span<const std::byte, HelloSize> Wire) noexcept {
+	const auto Size = get<uint16_t>(Wire.data() + 2);
+	return get<uint16_t>(Wire.data()) == HelloMagic && Size >= HelloSize &&
+	               Size <= MaxHelloSize
+	           ? Size
+	           : 0;
+}
+
+// features unknown to this version are dropped
+[[nodiscard]] constexpr Hello
+decodeHello(span<const std::byte, HelloSize> Wire) noexcept {
+	const auto * In = Wire.data();
+	return {
+		.Version_   = get<uint16_t>(In + 4),
+		.Features_  = static_cast<uint16_t>(get<uint16_t>(In + 6) &
+		                                   AllFeatures),
+		.MaxWidth_  = get<uint32_t>(In + 8),
+		.MaxHeight_ = get<uint32_t>(In + 12),
+	};
+}
+
+// both versions must survive the round trip
+constexpr bool roundTrips(const FrameHeader & Header) noexcept {
+	const auto Wire   = encode(Header);
+	const auto Prefix = span{ Wire.Bytes_ }.first<V1Size>();
+	const auto Back   = Wire.Size_ == V1Size ? decodeV1(Prefix)
+	                                         : decodeV2(span{ Wire.Bytes_ });
+	return version(Prefix) == (Wire.Size_ == V1Size ? 1u : 2u) &&
+	       Back.Width_ == Header.Width_ && Back.Height_ == Header.Height_ &&
+	       Back.LinePitch_ == Header.LinePitch_ &&
+	       Back.Format_ == Header.Format_ && Back.Flags_ == Header.Flags_ &&
+	       Back.Sequence_ == Header.Sequence_ &&
+	       Back.Timestamp_ == Header.Timestamp_ &&
+	       Back.PayloadSize_ == Header.PayloadSize_;
+}
+static_assert(
+    roundTrips({ 640, 480, 640, PAL8, Full, 7, 40ms, 640 * 480 + 1024 }));
+static_assert(roundTrips({ 640, 480, 2560, BGRA, Repeat, 1, 0ms, 0 }));
+static_assert(
+    roundTrips({ 10000, 2000, 40000, RGBA, Full, 3, 20ms, 80000000 }));
+static_assert(roundTrips({ 200, 100, 800, BGRA, Delta, -1, 5000s, 100 }));
+static_assert(roundTrips({ 64, 64, 64, PAL8, Packet | NewStream, 1, 0ms, 9 }));
+static_assert(encode({ 64, 64, 64, PAL8, Packet, 2, 10ms, 9 }).Size_ == V2Size);
+static_assert(encode({ 10000, 2000, 40000, RGBA, Full }).Size_ == V2Size);
+static_assert(encode({ 64, 64, 256, BGRA, Full | Packed }).Size_ == V2Size);
+static_assert(decodeHello(encode(Hello{ 2, 0xFFFF, 1920, 1080 })).Features_ ==
+              AllFeatures);
+} // namespace wire
+
 using tPixels = span<const std::byte>;
 
+// a counted reference to a libav buffer. Copies are just more references to
+// the same bytes. The buffer is released when the last reference is dropped,
+// back into the pool it was taken from if there is one
+
+using tBufferRef =
+    stdex::c_resource<AVBufferRef, av_buffer_alloc, av_buffer_unref>;
+
+struct Buffer : tBufferRef {
+	[[nodiscard]] constexpr Buffer() noexcept = default;
+	[[nodiscard]] explicit Buffer(size_t Size) noexcept
+	: tBufferRef(Size) {}
+	[[nodiscard]] Buffer(const Buffer & Other) noexcept {
+		if (Other)
+			reset(av_buffer_ref(Other.get()));
+	}
+	[[nodiscard]] Buffer(Buffer &&) noexcept = default;
+	Buffer & operator=(const Buffer & Other) noexcept {
+		if (this != &Other)
+			reset(Other ? av_buffer_ref(Other.get()) : nullptr);
+		return *this;
+	}
+	Buffer & operator=(Buffer &&) noexcept = default;
+
+	// take over the given reference
+	[[nodiscard]] static Buffer adopt(AVBufferRef * Reference) noexcept {
+		Buffer Result;
+		Result.reset(Reference);
+		return Result;
+	}
+	[[nodiscard]] std::byte * data() const noexcept {
+		return bit_cast<std::byte *>(get()->data);
+	}
+};
+
+// the compressed packet a frame is decoded from, for peers which decode the
+// frames themselves. Packets always own their bytes
+struct Compressed {
+	uint16_t Flags_ = 0; // NewStream if the packet is the first of a stream
+	tPixels Bytes_;
+	Buffer Buffer_;
+};
+
+// the pixels of a frame are either held by the frame's own buffer, or they
+// are borrowed from the producer of the frame and valid only until it moves
+// on. Frames which own their pixels may be queued, cached and shared freely
+
 struct Frame {
 	FrameHeader Header_;
 	tPixels Pixels_;
+	Buffer Buffer_;
+	Compressed Compressed_;
+
+	[[nodiscard]] bool owning() const noexcept {
+		return static_cast<bool>(Buffer_);
+	}
+	// a frame which owns its pixels, copied only if borrowed
+	[[nodiscard]] Frame owned() const {
+		if (owning() || Pixels_.empty())
+			return *this;
+		Frame Result{ Header_, {}, Buffer(Pixels_.size()), Compressed_ };
+		if (!Result.Buffer_)
+			throw bad_alloc{};
+		memcpy(Result.Buffer_.data(), Pixels_.data(), Pixels_.size());
+		Result.Pixels_ = { Result.Buffer_.data(), Pixels_.size() };
+		return Result;
+	}
 };
 
 video::Frame makeFiller(milliseconds Duration) {
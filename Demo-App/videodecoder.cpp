@@ -1,17 +1,45 @@
 ﻿module;
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <bit>
+#include <cerrno>
 #include <chrono>
+#include <climits>
 #include <coroutine>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
 #include <filesystem>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <ranges>
+#include <set>
+#include <shared_mutex>
 #include <span>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#ifdef __linux__
+#	include <poll.h>
+#	include <sys/inotify.h>
+#	include <unistd.h>
+#endif
 
 #include "c_resource.hpp"
 
 module video.decoder;
 
 import the.whole.caboodle;
+import asio;
 import libav;
+import media.catalog;
+import media.mapping;
 import print;
 
 using namespace std;         // bad practice - only for presentation!
@@ -27,12 +55,101 @@ namespace vws = rgs::views;
 // wrap the libav (a.k.a. FFmpeg https://ffmpeg.org/) C API types and their
 // assorted functions
 namespace libav {
+
+// media files are read through a custom I/O context from a memory mapping
+// which is shared by all readers of the same file. Reading ahead is hinted to
+// the OS in windows of ReadAhead bytes. The size of the file is checked when
+// it is opened and on every seek, a file truncated before that ends early. This
+// is best effort, a truncation while reading still faults
+
+struct MappedReader {
+	shared_ptr<const mapping::MappedFile> File_;
+	size_t Size_     = 0; // the intact bytes as of the last check
+	size_t Position_ = 0;
+	size_t Advised_  = 0; // the end of the range hinted so far
+};
+
+static constexpr int IOBufferSize = 64 * 1024;
+static constexpr size_t ReadAhead = 1024 * 1024;
+
+int readMapped(void * Opaque, uint8_t * Buffer, int Size) {
+	auto & Reader    = *static_cast<MappedReader *>(Opaque);
+	const auto Bytes = Reader.File_->bytes().first(Reader.Size_);
+	if (Reader.Position_ >= Bytes.size())
+		return AVERROR_EOF;
+	const auto Count =
+	    min(static_cast<size_t>(Size), Bytes.size() - Reader.Position_);
+	if (Reader.Position_ + Count > Reader.Advised_) {
+		Reader.File_->willNeed(Reader.Position_, ReadAhead);
+		Reader.Advised_ = Reader.Position_ + ReadAhead;
+	}
+	memcpy(Buffer, Bytes.data() + Reader.Position_, Count);
+	Reader.Position_ += Count;
+	return static_cast<int>(Count);
+}
+
+int64_t seekMapped(void * Opaque, int64_t Offset, int Whence) {
+	auto & Reader   = *static_cast<MappedReader *>(Opaque);
+	Reader.Size_    = Reader.File_->intact();
+	const auto Size = static_cast<int64_t>(Reader.Size_);
+	if (Whence & AVSEEK_SIZE)
+		return Size;
+
+	auto Position = static_cast<int64_t>(Reader.Position_);
+	switch (Whence & ~AVSEEK_FORCE) {
+		case SEEK_SET: Position = Offset; break;
+		case SEEK_CUR: Position += Offset; break;
+		case SEEK_END: Position = Size + Offset; break;
+		default: return -1;
+	}
+	if (Position < 0 || Position > Size)
+		return -1;
+	Reader.Position_ = static_cast<size_t>(Position);
+	Reader.Advised_  = Reader.Position_; // hint again on the next read
+	return Position;
+}
+
+// an I/O context reading from the mapping of a file, nullptr without one
+AVIOContext * openMapped(shared_ptr<const mapping::MappedFile> File) {
+	if (File == nullptr)
+		return nullptr;
+	auto Buffer = static_cast<unsigned char *>(av_malloc(IOBufferSize));
+	if (Buffer == nullptr)
+		return nullptr;
+	auto Reader   = new MappedReader{ .File_ = std::move(File) };
+	Reader->Size_ = Reader->File_->intact();
+	auto IO       = avio_alloc_context(Buffer, IOBufferSize, 0, Reader,
+	                                   readMapped, nullptr, seekMapped);
+	if (IO == nullptr) {
+		delete Reader;
+		av_free(Buffer);
+	}
+	return IO;
+}
+
+// libav leaves custom I/O contexts to their owners
+void closeMapped(AVIOContext * IO) {
+	if (IO == nullptr || IO->read_packet != readMapped)
+		return;
+	delete static_cast<MappedReader *>(IO->opaque);
+	av_freep(&IO->buffer);
+	avio_context_free(&IO);
+}
+
+void closeInput(AVFormatContext ** pContext) {
+	const auto IO = (*pContext)->pb;
+	avformat_close_input(pContext);
+	closeMapped(IO);
+}
+
 using Codec   = stdex::c_resource<AVCodecContext, avcodec_alloc_context3,
                                 avcodec_free_context>;
 using File    = stdex::c_resource<AVFormatContext, avformat_open_input,
-                               avformat_close_input>;
+                               closeInput>;
 using tFrame  = stdex::c_resource<AVFrame, av_frame_alloc, av_frame_free>;
 using tPacket = stdex::c_resource<AVPacket, av_packet_alloc, av_packet_free>;
+using BufferPool = stdex::c_resource<AVBufferPool, av_buffer_pool_init,
+                                     av_buffer_pool_uninit>;
 
 // frames and packets are reference-counted and always constructed non-empty
 struct Frame : tFrame {
@@ -54,109 +171,256 @@ struct Packet : tPacket {
 namespace videodecoder {
 
 //------------------------------------------------------------------------------
-// generate an endless stream of paths of the lastest contents of given
-// Directory on each iteration step paths are empty if there are none available
-
-struct EternalDirectoryIterator : rgs::view_base {
-	using base              = fs::directory_iterator;
-	using iterator_category = input_iterator_tag;
-	using difference_type   = ptrdiff_t;
-	using value_type        = fs::path;
-	using pointer           = const value_type *;
-	using reference         = const value_type &;
-
-	struct Sentinel {};
-
-	[[nodiscard]] EternalDirectoryIterator() noexcept = default;
-	[[nodiscard]] explicit EternalDirectoryIterator(fs::path Dir) noexcept
-	: Directory_{ move(Dir) }
-	, Iter_{ restart(Directory_) }
-	, None_{ Iter_ == End_ } {}
-
-	[[nodiscard]] bool
-	operator==(const EternalDirectoryIterator & rhs) const noexcept {
-		return Iter_ == rhs.Iter_;
-	}
-	[[nodiscard]] bool operator==(Sentinel) const noexcept {
-		return false;
-	}
+// the media files in a directory, i.e. those which pass a given filter
+// the list of files is kept up to date incrementally from change notifications
+// where the platform has them (inotify on Linux). Elsewhere, or if the
+// directory can't be watched, it is rescanned with an interval that grows
+// while nothing changes. Without any media files, it waits for changes rather
+// than spinning
 
-	[[nodiscard]] fs::path operator*() const noexcept {
-		if (None_)
-			return {};
-		return Iter_->path();
-	}
+class MediaDirectory {
+public:
+	using tFilter = function<bool(const fs::path &)>;
 
-	[[maybe_unused]] EternalDirectoryIterator & operator++() {
-		error_code Error;
-		if (Iter_ == End_ || Iter_.increment(Error) == End_)
-			Iter_ = restart(Directory_);
-		None_ = Error || Iter_ == End_;
-		return *this;
-	}
-	EternalDirectoryIterator & operator++(int);
+	[[nodiscard]] MediaDirectory(fs::path Directory, tFilter Filter);
+	~MediaDirectory();
+	MediaDirectory(const MediaDirectory &)             = delete;
+	MediaDirectory & operator=(const MediaDirectory &) = delete;
 
-	[[nodiscard]] friend inline EternalDirectoryIterator
-	begin(EternalDirectoryIterator it) {
-		return move(it);
-	}
-	[[nodiscard]] friend inline Sentinel end(EternalDirectoryIterator) {
-		return {};
-	}
+	// the file after the one returned last, cycling through all of them in
+	// order. Empty if there are none after waiting up to Patience for one
+	// files which no longer pass the filter are dropped on the way
+	[[nodiscard]] fs::path next(milliseconds Patience);
 
 private:
-	static base restart(const fs::path & Directory) {
-		error_code Error;
-		return base{ Directory, fs::directory_options::skip_permission_denied,
-			         Error };
-	}
+	static constexpr auto MinInterval = 100ms;
+	static constexpr auto MaxInterval = 5s;
+
+	void rescan();
+	void update(milliseconds Timeout);
+	void add(const fs::path & Path);
 
 	fs::path Directory_;
-	base Iter_;
-	base End_;
-	bool None_ = false;
+	tFilter Filter_;
+	set<fs::path> Files_;
+	fs::path Last_;
+
+	// polling
+	steady_clock::time_point NextScan_;
+	milliseconds Interval_ = MinInterval;
+
+#ifdef __linux__
+	// notifications
+	bool watch();
+	bool readEvents(milliseconds Timeout);
+
+	int Notify_ = -1;
+	int Watch_  = -1;
+#endif
 };
-} // namespace videodecoder
 
-using videodecoder::EternalDirectoryIterator;
+MediaDirectory::MediaDirectory(fs::path Directory, tFilter Filter)
+: Directory_{ std::move(Directory) }
+, Filter_{ std::move(Filter) } {
+#ifdef __linux__
+	Notify_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (watch())
+		return;
+#endif
+	rescan();
+	NextScan_ = steady_clock::now() + Interval_;
+}
+
+MediaDirectory::~MediaDirectory() {
+#ifdef __linux__
+	if (Notify_ >= 0)
+		close(Notify_);
+#endif
+}
+
+fs::path MediaDirectory::next(milliseconds Patience) {
+	update(0ms);
+	for (bool Waited = false;;) {
+		if (Files_.empty()) {
+			if (Waited)
+				return {};
+			update(Patience);
+			Waited = true;
+			continue;
+		}
+		auto Iter = Files_.upper_bound(Last_);
+		if (Iter == Files_.end())
+			Iter = Files_.begin();
+		Last_ = *Iter;
+		if (Filter_(Last_))
+			return Last_;
+		Files_.erase(Iter);
+	}
+}
 
-template <>
-constexpr bool rgs::enable_borrowed_range<EternalDirectoryIterator> =
-    rgs::enable_borrowed_range<EternalDirectoryIterator::base>;
+void MediaDirectory::add(const fs::path & Path) {
+	error_code Error;
+	if (Filter_(Path) && fs::is_regular_file(Path, Error))
+		Files_.insert(Path);
+}
 
-static_assert(input_iterator<EternalDirectoryIterator>);
-static_assert(rgs::range<EternalDirectoryIterator>);
-static_assert(rgs::viewable_range<EternalDirectoryIterator>);
-static_assert(rgs::borrowed_range<EternalDirectoryIterator>);
+void MediaDirectory::rescan() {
+	Files_.clear();
+	error_code Error;
+	for (fs::directory_iterator
+	         Iter{ Directory_, fs::directory_options::skip_permission_denied,
+		           Error },
+	     End;
+	     !Error && Iter != End; Iter.increment(Error))
+		add(Iter->path());
+}
+
+// take in the changes, waiting up to Timeout for the first one
+void MediaDirectory::update(milliseconds Timeout) {
+#ifdef __linux__
+	if (Watch_ >= 0 || watch()) {
+		if (readEvents(Timeout))
+			return;
+	}
+#endif
+	auto Now = steady_clock::now();
+	if (Now < NextScan_) {
+		if (Timeout <= 0ms)
+			return;
+		this_thread::sleep_for(
+		    min<steady_clock::duration>(Timeout, NextScan_ - Now));
+		Now = steady_clock::now();
+		if (Now < NextScan_)
+			return;
+	}
+	const auto Before = Files_;
+	rescan();
+	Interval_ = Files_ == Before ? min<milliseconds>(2 * Interval_, MaxInterval)
+	                             : MinInterval;
+	NextScan_ = Now + Interval_;
+}
+
+#ifdef __linux__
+bool MediaDirectory::watch() {
+	if (Notify_ < 0)
+		return false;
+	Watch_ = inotify_add_watch(Notify_, Directory_.c_str(),
+	                           IN_CREATE | IN_CLOSE_WRITE | IN_DELETE |
+	                               IN_MOVED_FROM | IN_MOVED_TO |
+	                               IN_DELETE_SELF | IN_MOVE_SELF);
+	if (Watch_ >= 0)
+		rescan(); // catch up with the changes before the watch
+	return Watch_ >= 0;
+}
+
+// false if the watch is gone and the directory needs to be polled
+bool MediaDirectory::readEvents(milliseconds Timeout) {
+	pollfd Poll{ .fd = Notify_, .events = POLLIN };
+	if (poll(&Poll, 1, static_cast<int>(Timeout.count())) <= 0)
+		return true;
+
+	alignas(inotify_event) char Events[16 * 1024];
+	for (;;) {
+		const auto Size = read(Notify_, Events, sizeof(Events));
+		if (Size <= 0)
+			return Watch_ >= 0;
+		for (auto * Next = Events; Next < Events + Size;) {
+			const auto & Event = *reinterpret_cast<const inotify_event *>(Next);
+			Next += sizeof(inotify_event) + Event.len;
+			if (Event.mask & IN_Q_OVERFLOW) {
+				rescan();
+			} else if (Event.wd != Watch_) {
+				continue; // left over from a previous watch
+			} else if (Event.mask & (IN_DELETE_SELF | IN_MOVE_SELF |
+			                         IN_IGNORED)) {
+				inotify_rm_watch(Notify_, Watch_);
+				Watch_ = -1;
+			} else if (Event.len > 0 && !(Event.mask & IN_ISDIR)) {
+				const auto Path = Directory_ / Event.name;
+				if (Event.mask & (IN_DELETE | IN_MOVED_FROM))
+					Files_.erase(Path);
+				else
+					add(Path);
+			}
+		}
+	}
+}
+#endif
+
+// generate an endless stream of paths of the media files in given Directory
+// paths are empty if there are none available
+
+generator<fs::path> watchDirectory(fs::path Directory,
+                                   MediaDirectory::tFilter Filter) {
+	MediaDirectory Media(std::move(Directory), std::move(Filter));
+	for (;;)
+		co_yield Media.next(100ms);
+}
 
-namespace videodecoder {
 // the setup stages, used in a view-pipeline
 
 static constexpr auto DetectStream  = -1;
 static constexpr auto FirstStream   = 0;
 static constexpr auto MainSubstream = 0;
 
-libav::File tryOpenFile(const fs::path & Path) {
+// open a media file from its memory mapping, or by name if it can't be mapped.
+// Returns the libav error code, negative if the file can't be opened
+
+int openInput(libav::File & File, const fs::path & Path) {
+	const auto Name = caboodle::utf8Path(Path);
+	auto IO         = libav::openMapped(mapping::MappedFile::open(Path));
+	if (IO == nullptr)
+		return File.replace(Name.c_str(), nullptr, nullptr);
+
+	auto Context = avformat_alloc_context();
+	if (Context == nullptr) {
+		libav::closeMapped(IO);
+		return -ENOMEM;
+	}
+	Context->pb = IO;
+	// the context is gone if this fails, but the I/O context is not
+	if (const auto Error =
+	        avformat_open_input(&Context, Name.c_str(), nullptr, nullptr);
+	    Error < 0) {
+		libav::closeMapped(IO);
+		return Error;
+	}
+	File.reset(Context);
+	return 0;
+}
+
+// nothing if the file can't be read right now, which may be different next
+// time. An empty file if there is no GIF video in it
+
+optional<libav::File> tryOpenFile(const fs::path & Path) {
 	libav::File File;
-	if (!Path.empty() &&
-	    File.replace(caboodle::utf8Path(Path).c_str(), nullptr, nullptr) >= 0) {
-		const AVCodec * pCodec;
-		if ((av_find_best_stream(File, AVMEDIA_TYPE_VIDEO, DetectStream, -1,
-		                         &pCodec, 0) != FirstStream) ||
-		    pCodec == nullptr || pCodec->id != AV_CODEC_ID_GIF)
-			File = {};
+	if (Path.empty())
+		return File;
+	if (const auto Error = openInput(File, Path); Error < 0) {
+		if (Error != AVERROR_INVALIDDATA)
+			return nullopt;
+		return libav::File{};
 	}
+	const AVCodec * pCodec;
+	if ((av_find_best_stream(File, AVMEDIA_TYPE_VIDEO, DetectStream, -1,
+	                         &pCodec, 0) != FirstStream) ||
+	    pCodec == nullptr || pCodec->id != AV_CODEC_ID_GIF)
+		File = {};
 	return File;
 }
 
-tuple<libav::File, libav::Codec> tryOpenDecoder(libav::File File) {
+// files known to be playable are opened without probing them again
+
+tuple<libav::File, libav::Codec> tryOpenDecoder(libav::File File,
+                                                bool Known = false) {
 	if (File.empty())
 		return {};
 
 	const AVCodec * pCodec;
-	avformat_find_stream_info(File, nullptr);
+	if (!Known)
+		avformat_find_stream_info(File, nullptr);
 	av_find_best_stream(File, AVMEDIA_TYPE_VIDEO, FirstStream, -1, &pCodec, 0);
-	if (File->duration > 0) {
+	if (Known || File->duration > 0) {
 		if (libav::Codec Decoder(pCodec); Decoder) {
 			avcodec_parameters_to_context(Decoder,
 			                              File->streams[FirstStream]->codecpar);
@@ -181,55 +445,622 @@ video::Frame makeVideoFrame(const libav::Frame & Frame, int FrameNumber,
 		                          .Format_    = video::fromLibav(Frame->format),
 		                          .Sequence_  = FrameNumber,
 		                          .Timestamp_ = Tick * Frame->pts };
+	Header.PayloadSize_ = Header.frameSize();
+	// take a reference to the decoder's buffer rather than a copy of it
+	auto Buffer = video::Buffer::adopt(
+	    Frame->buf[MainSubstream] ? av_buffer_ref(Frame->buf[MainSubstream])
+	                              : nullptr);
 	return { Header,
 		     { bit_cast<const std::byte *>(Frame->data[MainSubstream]),
-		       Header.size() } };
+		       Header.size() },
+		     std::move(Buffer) };
 }
 
+// the compressed packets go along with the frames decoded from them, for peers
+// which decode themselves. The first packet of a stream is prefixed by the
+// codec parameters, such that a peer can set up its decoder from it
+
+video::Compressed makeCompressed(const libav::Packet & Packet,
+                                 const AVCodecParameters * Stream) {
+	const auto Data = span{ bit_cast<const std::byte *>(Packet->data),
+		                    static_cast<size_t>(Packet->size) };
+	if (Stream == nullptr && Packet->buf)
+		return { 0, Data, video::Buffer::adopt(av_buffer_ref(Packet->buf)) };
+
+	const auto Extra = Stream ? static_cast<size_t>(Stream->extradata_size) : 0;
+	const auto Prefix = Stream ? sizeof(video::StreamHeader) + Extra : 0;
+	video::Buffer Buffer(Prefix + Data.size());
+	if (!Buffer)
+		throw bad_alloc{};
+	auto * Out = Buffer.data();
+	if (Stream) {
+		const video::StreamHeader Info{
+			.Codec_     = static_cast<uint32_t>(Stream->codec_id),
+			.Width_     = Stream->width,
+			.Height_    = Stream->height,
+			.ExtraSize_ = static_cast<uint32_t>(Extra)
+		};
+		memcpy(Out, &Info, sizeof(Info));
+		if (Extra > 0)
+			memcpy(Out + sizeof(Info), Stream->extradata, Extra);
+	}
+	if (!Data.empty())
+		memcpy(Out + Prefix, Data.data(), Data.size());
+	return { Stream ? video::NewStream : uint16_t{ 0 },
+		     { Out, Prefix + Data.size() },
+		     std::move(Buffer) };
+}
+
+// GIFs are natively indexed with up to 256 colours per frame, but the decoder
+// composes RGBA frames from them. Recover the indexed representation, which
+// is a quarter of the size. Frames with more colours (e.g. from multiple local
+// palettes) are passed on unchanged. The indexed frames are taken from a pool
+// of buffers which are recycled once their last holder has dropped them
+
+class Indexer {
+public:
+	[[nodiscard]] video::Frame operator()(video::Frame Frame) {
+		const auto & Header = Frame.Header_;
+		if (Header.empty() ||
+		    (Header.format() != video::RGBA && Header.format() != video::BGRA))
+			return Frame;
+
+		const auto Size = video::PaletteBytes +
+		                  static_cast<size_t>(Header.Width_) * Header.Height_;
+		if (Size != PoolSize_) {
+			Pool_     = libav::BufferPool(Size, av_buffer_alloc);
+			PoolSize_ = Size;
+		}
+		auto Buffer = video::Buffer::adopt(av_buffer_pool_get(Pool_));
+		if (!Buffer)
+			return Frame;
+
+		// keep the palette of the frame before if possible, this keeps the
+		// indices of consecutive frames comparable
+		auto * Bytes = Buffer.data();
+		if (!index(Frame, Bytes + video::PaletteBytes)) {
+			reset();
+			if (!index(Frame, Bytes + video::PaletteBytes)) {
+				reset();
+				return Frame;
+			}
+		}
+		writePalette(Bytes, Header.format() == video::RGBA);
+
+		auto Indexed         = Header;
+		Indexed.Format_      = video::PAL8;
+		Indexed.LinePitch_   = Header.Width_;
+		Indexed.PayloadSize_ = Indexed.frameSize();
+		return { Indexed, { Bytes, Size }, std::move(Buffer) };
+	}
+
+private:
+	static constexpr auto Slots = 2 * video::PaletteEntries;
+
+	bool index(const video::Frame & Frame, std::byte * Indices) noexcept {
+		const auto & Header = Frame.Header_;
+		for (int y = 0; y < Header.Height_; ++y) {
+			const auto * Row = Frame.Pixels_.data() +
+			                   static_cast<size_t>(y) * Header.LinePitch_;
+			uint32_t Last  = 0;
+			auto LastIndex = std::byte{ 0 };
+			for (int x = 0; x < Header.Width_; ++x, ++Indices) {
+				uint32_t Pixel;
+				memcpy(&Pixel, Row + 4 * x, sizeof(Pixel));
+				if (x == 0 || Pixel != Last) {
+					const auto Index = lookup(Pixel);
+					if (Index < 0)
+						return false;
+					Last      = Pixel;
+					LastIndex = static_cast<std::byte>(Index);
+				}
+				*Indices = LastIndex;
+			}
+		}
+		return true;
+	}
+
+	void reset() noexcept {
+		ranges::fill(Used_, false);
+		ranges::fill(Palette_, 0u);
+		Colours_ = 0;
+	}
+
+	// open addressing with linear probing, -1 if the palette is full
+	int lookup(uint32_t Colour) noexcept {
+		for (auto Slot = (Colour * 2654435761u) >> 23;;
+		     Slot      = (Slot + 1) % Slots) {
+			if (!Used_[Slot]) {
+				if (Colours_ == video::PaletteEntries)
+					return -1;
+				Used_[Slot]          = true;
+				Keys_[Slot]          = Colour;
+				Indices_[Slot]       = static_cast<uint8_t>(Colours_);
+				Palette_[Colours_++] = Colour;
+				return Indices_[Slot];
+			}
+			if (Keys_[Slot] == Colour)
+				return Indices_[Slot];
+		}
+	}
+
+	void writePalette(std::byte * Entry, bool SwapRedBlue) noexcept {
+		for (unsigned i = 0; i < video::PaletteEntries; ++i, Entry += 4) {
+			memcpy(Entry, &Palette_[i], 4);
+			if (SwapRedBlue)
+				swap(Entry[0], Entry[2]);
+		}
+	}
+
+	libav::BufferPool Pool_;
+	size_t PoolSize_ = 0;
+	array<bool, Slots> Used_{};
+	array<uint32_t, Slots> Keys_;
+	array<uint8_t, Slots> Indices_;
+	array<uint32_t, video::PaletteEntries> Palette_{};
+	unsigned Colours_ = 0;
+};
+
+// GIF packets decode into exactly one frame each, which takes the packet along
+
 generator<video::Frame> decodeFrames(libav::File File, libav::Codec Decoder) {
 	libav::Packet Packet;
 	libav::Frame Frame;
-	const auto Tick = getTickDuration(File);
+	Indexer Index;
+	const auto Tick   = getTickDuration(File);
+	const auto Stream = File->streams[FirstStream]->codecpar;
+	bool First        = true;
 
 	while (av_read_frame(File, Packet) >= 0) {
 		const auto PGuard = Packet.dropReference();
 		if (Packet->stream_index != FirstStream)
 			continue;
+		auto Compressed =
+		    makeCompressed(Packet, exchange(First, false) ? Stream : nullptr);
 		for (auto rc = avcodec_send_packet(Decoder, Packet); rc >= 0;) {
 			rc                = avcodec_receive_frame(Decoder, Frame);
 			const auto FGuard = Frame.dropReference();
-			if (rc >= 0)
-				co_yield makeVideoFrame(Frame, Decoder->frame_number, Tick);
-			else if (rc == AVERROR_EOF)
+			if (rc >= 0) {
+				auto Decoded =
+				    Index(makeVideoFrame(Frame, Decoder->frame_number, Tick));
+				Decoded.Compressed_ = exchange(Compressed, {});
+				co_yield std::move(Decoded);
+			} else if (rc == AVERROR_EOF) {
 				co_return;
+			}
 		}
 	}
 }
 
-auto hasExtension(string_view Extension) {
-	return [=](const fs::path & p) {
-		return p.empty() || p.extension() == Extension;
+//------------------------------------------------------------------------------
+// a cache of fully decoded frame sequences, keyed by the file path and
+// validated by the file's modification time and size. The least recently used
+// sequences are evicted when the byte budget is exceeded. Any number of
+// readers may look up sequences concurrently
+
+using catalog::FileStamp;
+
+// the frames of a sequence hold references to their buffers, recording them
+// takes no copies
+struct Sequence {
+	vector<video::Frame> Frames_;
+	size_t Bytes_ = 0;
+};
+
+class FrameCache {
+public:
+	void limit(size_t Budget) {
+		const lock_guard Lock(Mutex_);
+		Budget_ = Budget;
+		evict(0);
+	}
+	[[nodiscard]] size_t budget() const noexcept {
+		return Budget_;
+	}
+
+	[[nodiscard]] shared_ptr<const Sequence> find(const fs::path & Path,
+	                                              const FileStamp & Stamp) {
+		const shared_lock Lock(Mutex_);
+		const auto Iter = Entries_.find(Path.native());
+		if (Iter == Entries_.end() || Iter->second.Stamp_ != Stamp)
+			return {};
+		Iter->second.LastUse_.store(++Clock_, memory_order_relaxed);
+		return Iter->second.Sequence_;
+	}
+
+	void insert(const fs::path & Path, const FileStamp & Stamp,
+	            shared_ptr<const Sequence> Frames) {
+		const auto Size = Frames->Bytes_;
+		const lock_guard Lock(Mutex_);
+		if (auto Iter = Entries_.find(Path.native()); Iter != Entries_.end()) {
+			Used_ -= Iter->second.Sequence_->Bytes_;
+			Entries_.erase(Iter);
+		}
+		if (Size > Budget_)
+			return;
+		evict(Size);
+		Used_ += Size;
+		Entries_.try_emplace(Path.native(), Stamp, std::move(Frames), ++Clock_);
+	}
+
+private:
+	struct Entry {
+		FileStamp Stamp_;
+		shared_ptr<const Sequence> Sequence_;
+		atomic<uint64_t> LastUse_;
 	};
+
+	// precondition: exclusive lock
+	void evict(size_t Room) {
+		while (!Entries_.empty() && Used_ + Room > Budget_) {
+			const auto Oldest = rgs::min_element(Entries_, {}, [](const auto & E) {
+				return E.second.LastUse_.load(memory_order_relaxed);
+			});
+			Used_ -= Oldest->second.Sequence_->Bytes_;
+			Entries_.erase(Oldest);
+		}
+	}
+
+	shared_mutex Mutex_;
+	unordered_map<fs::path::string_type, Entry> Entries_;
+	atomic<uint64_t> Clock_ = 0;
+	size_t Used_            = 0;
+	size_t Budget_          = 256 << 20;
+};
+
+FrameCache Cache;
+
+void limitFrameCache(size_t Bytes) {
+	Cache.limit(Bytes);
 }
 
-generator<video::Frame> makeFrames(fs::path Directory) {
-	const auto EndlessStreamOfPaths = EternalDirectoryIterator(move(Directory));
-	// clang-format off
-	auto MisEnPlace = EndlessStreamOfPaths
-		            | vws::filter(hasExtension(".gif"))
-		            | vws::transform(tryOpenFile)
-		            | vws::transform(tryOpenDecoder)
-		            ;
-	// clang-format on
+//------------------------------------------------------------------------------
+// the catalog of media files tells which files are videos at all, and what
+// they are like. It is filled while playing, and ahead of time by a number of
+// probing threads at startup
+
+catalog::Catalog Catalog;
 
-	for (auto [File, Decoder] : MisEnPlace) {
-		if (Decoder) {
-			println("decoding <{}>", File->url);
-			co_yield rgs::elements_of(
-			    decodeFrames(std::move(File), std::move(Decoder)));
-		} else {
-			co_yield video::makeFiller(100ms);
+auto hasExtension(string_view Extension) {
+	return [=](const fs::path & p) { return p.extension() == Extension; };
+}
+
+// nothing if the file can't be read right now
+optional<catalog::Entry> probe(const fs::path & Path, const FileStamp & Stamp) {
+	auto Opened = tryOpenFile(Path);
+	if (!Opened)
+		return nullopt;
+	catalog::Entry Info{ .Stamp_ = Stamp };
+	auto [File, Decoder] = tryOpenDecoder(move(*Opened));
+	if (!Decoder)
+		return Info;
+
+	Info.Playable_ = true;
+	Info.Codec_    = Decoder->codec_id;
+	Info.Width_    = Decoder->width;
+	Info.Height_   = Decoder->height;
+	Info.Duration_ = File->duration;
+
+	// the timestamps are known from the packets, no need to decode them
+	const auto Tick = getTickDuration(File);
+	libav::Packet Packet;
+	while (av_read_frame(File, Packet) >= 0) {
+		const auto PGuard = Packet.dropReference();
+		if (Packet->stream_index == FirstStream)
+			Info.Timestamps_.push_back((Tick * Packet->pts).count());
+	}
+	return Info;
+}
+
+fs::path CatalogFile;
+jthread Probing;
+
+void openCatalog(fs::path File, fs::path Directory, unsigned Threads) {
+	if (!File.empty())
+		Catalog.load(File);
+	CatalogFile = File;
+
+	Probing = jthread([=](stop_token Stop) {
+		vector<fs::path> Unknown;
+		error_code Error;
+		for (fs::directory_iterator
+		         Iter{ Directory, fs::directory_options::skip_permission_denied,
+			           Error },
+		     End;
+		     !Error && Iter != End; Iter.increment(Error)) {
+			const auto & Path = Iter->path();
+			if (hasExtension(".gif")(Path) &&
+			    !Catalog.find(Path, catalog::getStamp(Path)))
+				Unknown.push_back(Path);
+		}
+
+		atomic<size_t> Next = 0;
+		{
+			vector<jthread> Workers;
+			for (unsigned i = 0; i < max(Threads, 1u); ++i)
+				Workers.emplace_back([&] {
+					for (size_t Index;
+					     !Stop.stop_requested() &&
+					     (Index = Next++) < Unknown.size();) {
+						const auto & Path = Unknown[Index];
+						const auto Stamp  = catalog::getStamp(Path);
+						if (Catalog.find(Path, Stamp))
+							continue;
+						if (auto Info = probe(Path, Stamp))
+							Catalog.insert(Path, move(*Info));
+					}
+				});
+		}
+		if (!File.empty())
+			Catalog.save(File);
+	});
+}
+
+void closeCatalog() {
+	Probing = {};
+	if (!CatalogFile.empty())
+		Catalog.save(CatalogFile);
+}
+
+// decode a file while recording the frames into the cache. A recording that
+// would exceed the byte budget is abandoned, an incomplete one never makes it
+// into the cache. Only files which turn out to hold nothing playable are
+// recorded as such in the catalog, files which can't be read are tried again
+// next time
+
+generator<video::Frame> decodeAndRecord(fs::path Path, FileStamp Stamp) {
+	// only files known to be playable are trusted to be so still
+	const auto Known = Catalog.find(Path, Stamp);
+	const auto Trust = Known && Known->Playable_;
+	auto Opened      = tryOpenFile(Path);
+	if (!Opened) {
+		co_yield video::makeFiller(100ms);
+		co_return;
+	}
+	auto [File, Decoder] = tryOpenDecoder(move(*Opened), Trust);
+	if (!Decoder) {
+		Catalog.insert(Path, { .Stamp_ = Stamp });
+		co_yield video::makeFiller(100ms);
+		co_return;
+	}
+	println("decoding <{}>", File->url);
+
+	auto Info = catalog::Entry{ .Stamp_    = Stamp,
+		                        .Playable_ = true,
+		                        .Codec_    = Decoder->codec_id,
+		                        .Width_    = Decoder->width,
+		                        .Height_   = Decoder->height,
+		                        .Duration_ = File->duration };
+	auto Recording = make_shared<Sequence>();
+	for (const auto & Frame :
+	     decodeFrames(std::move(File), std::move(Decoder))) {
+		if (Recording) {
+			const auto Bytes =
+			    Frame.Pixels_.size() + Frame.Compressed_.Bytes_.size();
+			if (Recording->Bytes_ + Bytes > Cache.budget()) {
+				Recording.reset();
+			} else {
+				Recording->Frames_.push_back(Frame.owned());
+				Recording->Bytes_ += Bytes;
+			}
 		}
+		Info.Timestamps_.push_back(Frame.Header_.Timestamp_.count());
+		co_yield Frame;
 	}
+	if (!Trust)
+		Catalog.insert(Path, std::move(Info));
+	if (Recording && !Recording->Frames_.empty())
+		Cache.insert(Path, Stamp, std::move(Recording));
+}
+
+generator<video::Frame> playFile(fs::path Path) {
+	const auto Stamp = catalog::getStamp(Path);
+	if (const auto Cached = Cache.find(Path, Stamp)) {
+		for (const auto & Frame : Cached->Frames_)
+			co_yield Frame;
+	} else {
+		co_yield rgs::elements_of(decodeAndRecord(Path, Stamp));
+	}
+}
+
+// files which are known to be no videos are skipped, until they change
+bool isMedia(const fs::path & Path) {
+	if (!hasExtension(".gif")(Path))
+		return false;
+	const auto Known = Catalog.find(Path, catalog::getStamp(Path));
+	return !Known || Known->Playable_;
+}
+
+// all media files in a directory, once and in the order they are played in
+// nothing is cached or catalogued, this is for packing frame archives
+
+generator<video::Frame> decodeDirectory(fs::path Directory) {
+	set<fs::path> Files;
+	error_code Error;
+	for (fs::directory_iterator
+	         Iter{ Directory, fs::directory_options::skip_permission_denied,
+		           Error },
+	     End;
+	     !Error && Iter != End; Iter.increment(Error)) {
+		if (hasExtension(".gif")(Iter->path()))
+			Files.insert(Iter->path());
+	}
+	for (const auto & Path : Files) {
+		auto Opened = tryOpenFile(Path);
+		if (!Opened)
+			continue;
+		auto [File, Decoder] = tryOpenDecoder(move(*Opened));
+		if (!Decoder)
+			continue;
+		println("decoding <{}>", File->url);
+		co_yield rgs::elements_of(
+		    decodeFrames(std::move(File), std::move(Decoder)));
+	}
+}
+
+//------------------------------------------------------------------------------
+// opening and probing a file, and decoding its first frames takes time, in
+// particular from cold storage. Do that for the next few files ahead of time,
+// on the decode pool while the current file is still playing. Then there is no
+// gap between files
+
+static constexpr auto PrefetchFiles  = 2;
+static constexpr auto PrefetchFrames = 4;
+
+using tFrames = generator<video::Frame>;
+
+struct Prefetched {
+	tFrames Frames_;
+	optional<rgs::iterator_t<tFrames>> Next_;
+	vector<video::Frame> Head_;
+};
+
+generator<video::Frame> playOrFill(fs::path Path) {
+	if (!Path.empty())
+		co_yield rgs::elements_of(playFile(std::move(Path)));
+	else
+		co_yield video::makeFiller(100ms);
+}
+
+unique_ptr<Prefetched> prefetch(fs::path Path) {
+	auto Ahead     = make_unique<Prefetched>(playOrFill(std::move(Path)));
+	auto & Frame   = Ahead->Next_.emplace(Ahead->Frames_.begin());
+	const auto End = Ahead->Frames_.end();
+	for (; Ahead->Head_.size() < PrefetchFrames && Frame != End; ++Frame)
+		Ahead->Head_.push_back((*Frame).owned());
+	return Ahead;
+}
+
+// a prefetch is run by whoever gets to it first: a thread of the pool, or the
+// consumer when it needs the frames before the pool got around to it. No one
+// ever waits for a prefetch which is stuck in the queue of a busy pool
+
+class PrefetchJob {
+public:
+	[[nodiscard]] explicit PrefetchJob(fs::path Path)
+	: Task_{ [Path = std::move(Path)] { return prefetch(Path); } }
+	, Result_{ Task_.get_future() } {}
+
+	void run() {
+		if (!Taken_.test_and_set())
+			Task_();
+	}
+	[[nodiscard]] unique_ptr<Prefetched> get() {
+		run();
+		return Result_.get();
+	}
+
+private:
+	packaged_task<unique_ptr<Prefetched>()> Task_;
+	future<unique_ptr<Prefetched>> Result_;
+	atomic_flag Taken_;
+};
+
+// the frames decoded ahead of time first, then the rest
+generator<video::Frame> play(unique_ptr<Prefetched> Ahead) {
+	for (auto & Frame : Ahead->Head_)
+		co_yield std::move(Frame);
+	for (auto & Frame = *Ahead->Next_; Frame != Ahead->Frames_.end(); ++Frame)
+		co_yield *Frame;
+}
+
+generator<video::Frame> makeFrames(fs::path Directory,
+                                   asio::any_io_executor Prefetch) {
+	auto MisEnPlace = watchDirectory(move(Directory), isMedia);
+	auto Path       = MisEnPlace.begin();
+
+	deque<shared_ptr<PrefetchJob>> Ahead;
+	for (;;) {
+		while (Ahead.size() <= PrefetchFiles) {
+			auto Job = make_shared<PrefetchJob>(*Path);
+			asio::post(Prefetch, [Job] { Job->run(); });
+			Ahead.push_back(std::move(Job));
+			++Path;
+		}
+		auto Current = Ahead.front()->get();
+		Ahead.pop_front();
+		co_yield rgs::elements_of(play(std::move(Current)));
+	}
+}
+
+//------------------------------------------------------------------------------
+// clients which take the compressed packets decode them with a decoder of
+// their own. Only GIF decoders are set up, the server sends nothing else
+
+struct PacketDecoder::State {
+	libav::Codec Decoder_;
+	libav::Packet Packet_;
+	libav::Frame Frame_;
+	video::FrameHeader Last_{}; // of the frame decoded last
+};
+
+PacketDecoder::PacketDecoder()
+: State_{ make_unique<State>() } {}
+
+PacketDecoder::~PacketDecoder() = default;
+
+// precondition: Setup starts with a StreamHeader
+bool PacketDecoder::open(video::tPixels & Setup) {
+	auto & Decoder = State_->Decoder_;
+	Decoder        = {};
+	video::StreamHeader Info;
+	if (Setup.size() < sizeof(Info))
+		return false;
+	memcpy(&Info, Setup.data(), sizeof(Info));
+	Setup = Setup.subspan(sizeof(Info));
+	if (Info.Codec_ != AV_CODEC_ID_GIF || Info.ExtraSize_ > Setup.size())
+		return false;
+
+	const auto pCodec = avcodec_find_decoder(AV_CODEC_ID_GIF);
+	if (libav::Codec Fresh(pCodec); Fresh) {
+		Fresh->width  = Info.Width_;
+		Fresh->height = Info.Height_;
+		if (Info.ExtraSize_ > 0) {
+			// freed along with the decoder
+			Fresh->extradata = static_cast<uint8_t *>(
+			    av_mallocz(Info.ExtraSize_ + AV_INPUT_BUFFER_PADDING_SIZE));
+			if (Fresh->extradata == nullptr)
+				return false;
+			memcpy(Fresh->extradata, Setup.data(), Info.ExtraSize_);
+			Fresh->extradata_size = static_cast<int>(Info.ExtraSize_);
+		}
+		if (avcodec_open2(Fresh, pCodec, nullptr) >= 0)
+			Decoder = std::move(Fresh);
+	}
+	Setup = Setup.subspan(Info.ExtraSize_);
+	return !Decoder.empty();
+}
+
+video::Frame PacketDecoder::decode(const video::Frame & Packet) {
+	const auto & Header = Packet.Header_;
+	auto Bytes          = Packet.Pixels_;
+
+	auto & [Decoder, Compressed, Frame, Last] = *State_;
+
+	// leave the picture as it is if the packet can't be decoded
+	auto Unchanged         = Last;
+	Unchanged.Flags_       = video::Repeat;
+	Unchanged.Sequence_    = Header.Sequence_;
+	Unchanged.Timestamp_   = Header.Timestamp_;
+	Unchanged.PayloadSize_ = 0;
+
+	if ((Header.Flags_ & video::NewStream) && !open(Bytes))
+		return { Unchanged, {} };
+	if (Decoder.empty() || Bytes.size() > INT_MAX ||
+	    av_new_packet(Compressed, static_cast<int>(Bytes.size())) < 0)
+		return { Unchanged, {} };
+	const auto PGuard = Compressed.dropReference();
+	if (!Bytes.empty())
+		memcpy(Compressed->data, Bytes.data(), Bytes.size());
+
+	if (avcodec_send_packet(Decoder, Compressed) < 0 ||
+	    avcodec_receive_frame(Decoder, Frame) < 0)
+		return { Unchanged, {} };
+	const auto FGuard = Frame.dropReference();
+	auto Decoded      = makeVideoFrame(Frame, Header.Sequence_, 0us);
+
+	Decoded.Header_.Timestamp_ = Header.Timestamp_; // as sent
+	Last                       = Decoded.Header_;
+	return Decoded;
 }
 } // namespace videodecoder
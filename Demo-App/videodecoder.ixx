@@ -1,10 +1,46 @@
 module;
+#include <cstddef>
 #include <filesystem>
+#include <memory>
 
 export module video.decoder;
+import asio;
 import generator;
 import video;
 
 namespace videodecoder {
-export std::generator<video::Frame> makeFrames(std::filesystem::path);
+// the files coming up next are decoded ahead of time on the given executor
+export std::generator<video::Frame> makeFrames(std::filesystem::path,
+                                               asio::any_io_executor Prefetch);
+// all media files in a directory once, rather than endlessly
+export std::generator<video::Frame> decodeDirectory(std::filesystem::path);
+
+// the byte budget of the cache of decoded frame sequences, shared by all
+// frame generators
+export void limitFrameCache(std::size_t Bytes);
+
+// the catalog of media files, kept in the given file if any. The files in the
+// media directory which are not in the catalog yet are probed by the given
+// number of threads in the background
+export void openCatalog(std::filesystem::path File,
+                        std::filesystem::path MediaDirectory, unsigned Threads);
+// stop probing, and keep what is known
+export void closeCatalog();
+
+// decodes the compressed packets of a stream on the receiving end
+export class PacketDecoder {
+public:
+	[[nodiscard]] PacketDecoder();
+	~PacketDecoder();
+
+	// the frame decoded from a frame of kind Packet, valid until the next call.
+	// A repeat of the frame before if the packet can't be decoded
+	[[nodiscard]] video::Frame decode(const video::Frame & Packet);
+
+private:
+	bool open(video::tPixels & Setup);
+
+	struct State;
+	std::unique_ptr<State> State_;
+};
 }
@@ -36,20 +36,37 @@ export {
 #define EXP(x) export constexpr inline auto AV_##x = libav::x
 #define DCLERR(x) constexpr inline auto x = AVERROR_##x
 #define EXPERR(x) export constexpr inline auto AVERROR_##x = libav::error::x
+#define DCLSEEK(x) constexpr inline auto x = AVSEEK_##x
+#define EXPSEEK(x) export constexpr inline auto AVSEEK_##x = libav::seek::x
 
 // this is the bare minimum!
 // to export all libav macro definitions use X-macros
 
 export namespace libav {
 DCL(TIME_BASE);
+DCL(INPUT_BUFFER_PADDING_SIZE);
 
 namespace error {
 DCLERR(EOF);
+DCLERR(INVALIDDATA);
 } // namespace error
+
+namespace seek {
+DCLSEEK(SIZE);
+DCLSEEK(FORCE);
+} // namespace seek
 } // namespace libav
 
 #undef AV_TIME_BASE
+#undef AV_INPUT_BUFFER_PADDING_SIZE
 #undef AVERROR_EOF
+#undef AVERROR_INVALIDDATA
+#undef AVSEEK_SIZE
+#undef AVSEEK_FORCE
 
 EXP(TIME_BASE);
+EXP(INPUT_BUFFER_PADDING_SIZE);
 EXPERR(EOF);
+EXPERR(INVALIDDATA);
+EXPSEEK(SIZE);
+EXPSEEK(FORCE);